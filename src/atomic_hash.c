@@ -26,13 +26,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <ctype.h>
 #include <poll.h>
 #include <math.h>
 #include <assert.h>
 #include <sys/time.h>
 #include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include "atomic_hash.h"
+#include "seat_match.h"
 
 #if defined (MPQ3HASH) || defined (NEWHASH)
 #define NKEY 3
@@ -42,36 +49,181 @@
 
 #define NMHT 2
 #define NCLUSTER 4
-#define NSEAT (NMHT*NKEY*NCLUSTER)
+#define NGROUP 2 /* groups per key in one bucket array */
+#define NGRP (NMHT*NGROUP)
+#define NSEAT (NGRP*NGSEAT)
 #define NNULL 0xFFFFFFFF
 #define MAXTAB NNULL
 #define MINTAB 64
+#define STASH_BITS 3 /* log2 of groups in stash level 0: MINTAB / NGSEAT */
 #define COLLISION 1000 /* 0.01 ~> avg 25 in seat */
 #define MAXBLOCKS 1024
 #define MAXSPIN (1<<20) /* 2^20 loops 40ms with pause + sched_yield on xeon E5645 */
+#define HOLD_SPIN 1024 /* pauses of backoff on a held node before parking, default of opts->spin ... */
+#define HOLD_BACKOFF 64 /* ... in rounds of 1, 2, 4 .. 64 pauses */
+#define HOLD_PARK_MS 1000 /* parked up to 1s by default (opts->park_ms), then give up: an escape */
+#define PARK_BITS 6 /* 64 counters of threads parked, by node address */
+#define BF_K 4 /* counters per key, all in one 64-bytes block */
+#define BF_PER_KEY 12 /* counters per max_nodes, ~0.5% false positive */
+#define DISPLACE_LOAD 0.95 /* HASH_DISPLACE: keys per seat of array 1 and 2 together, 0.97 spills to the stash */
+#define DISPLACE_RETRY 4 /* probes again of a lookup that missed while keys moved */
+#define MOVES_RUN 0xffff /* h->mseq[home]: moves of keys of home running ... */
+#define MOVE_DONE 0x10000 /* ... and done, from this bit up */
+#define POOL_LOW 0.25 /* HASH_ELASTIC: trim down to this ratio of free nodes */
+#define POOL_HIGH 0.5 /* HASH_ELASTIC: trim when more nodes than this ratio are free */
+#define TRIM_MS 1000 /* HASH_ELASTIC: min interval of trims ... */
+#define TRIM_VISIT 4096 /* ... visiting up to 4096 blocks */
+#define SWEEP_MS 1 /* HASH_ELASTIC: one sweep step per 1ms ... */
+#define SWEEP_STEP 1024 /* ... moving 1024 free nodes, or more ... */
+#define SWEEP_PASS 1000 /* ... for a pass over the pooled nodes in 1000 steps */
+#define RESERVE_DIV 16 /* HASH_PREALLOC: default reserve, max_nodes / 16 ... */
+#define RESERVE_MIN_BLOCKS 4 /* ... but no less than 4 blocks of nodes */
+#define PREALLOC_US 1000 /* HASH_PREALLOC: helper thread checks the reserve every 1ms */
+#define COMPACT_FREE 0.5 /* HASH_COMPACT: plan when more than half of pooled nodes are free ... */
+#define COMPACT_SPARSE 4 /* ... draining blocks with no more than 1/4 of their nodes live, */
+#define COMPACT_VISIT 4096 /* ... up to 4096 blocks visited per plan */
+#define COMPACT_MS 10 /* HASH_COMPACT: one step per 10ms ... */
+#define COMPACT_STEP 1024 /* ... visiting 1024 seats, or more ... */
+#define COMPACT_PASS 100 /* ... for a pass over all seats in 100 steps */
+#define SMALL_TICK_SHIFT 4 /* HASH_SMALL: node expire in ticks of 16ms */
+#define VER_SHIFT 48 /* node_t expire: ms in the low bits, node version above */
+#define TTL_SLACK 4 /* HASH_OPTREAD: ttl refreshed once 1/4 of it has passed */
+#define EPOCH_EVERY 64 /* HASH_EPOCH: retires between tries to advance the epoch */
+#define HUGE_2M (1UL << 21) /* HASH_HUGEPAGE: page sizes tried, and the block size */
+#define HUGE_1G (1UL << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#define NUMA_MAX 64 /* HASH_NUMA: nodes handled, one bit each of a mask */
+#define MAP_MIN (1UL << 20) /* default allocator: larger sizes are mapped */
+#define PREFAULT_SLICE (64UL << 20) /* HASH_PREFAULT: bytes per thread, at least */
+#define PREFAULT_THREADS 64
 
 #define memword __attribute__((aligned(sizeof(void *))))
-#define atomic_add1(v) __sync_fetch_and_add(&(v), 1)
-#define atomic_sub1(v) __sync_fetch_and_sub(&(v), 1)
-#define add1(v) __sync_fetch_and_add(&(v), 1)
-#define cas(dst, old, new) __sync_bool_compare_and_swap((dst), (old), (new))
-#define ip(mp, type, i) (((type *)(mp->ba[(i) >> mp->shift]))[(i) & mp->mask])
+/* C11 memory orders on the plain fields of the hash, by the __atomic builtins
+ * <stdatomic.h> is made of: a word shared by threads is only read by ld*()
+ * and written by st*() or an RMW, with the weakest order its protocol needs */
+#define ld(v) __atomic_load_n (&(v), memory_order_relaxed)
+#define ld_acq(v) __atomic_load_n (&(v), memory_order_acquire)
+#define st(v, n) __atomic_store_n (&(v), (n), memory_order_relaxed)
+#define st_rel(v, n) __atomic_store_n (&(v), (n), memory_order_release) /* writes before it are seen with n */
+#define addn(v, n) __atomic_fetch_add (&(v), (n), memory_order_relaxed) /* a count that orders nothing */
+#define subn(v, n) __atomic_fetch_sub (&(v), (n), memory_order_relaxed)
+#define add1(v) addn (v, 1)
+#define atomic_add1(v) __atomic_fetch_add (&(v), 1, memory_order_seq_cst) /* a count other threads act on */
+#define atomic_sub1(v) __atomic_fetch_sub (&(v), 1, memory_order_seq_cst)
+#define cas_mo(dst, old, new, mo) ({ __typeof__ (*(dst)) __e = (old); \
+          __atomic_compare_exchange_n ((dst), (void *) &__e, (new), 0, (mo), memory_order_relaxed); })
+#define cas(dst, old, new) cas_mo (dst, old, new, memory_order_seq_cst)
+#define cas_acq(dst, old, new) cas_mo (dst, old, new, memory_order_acquire) /* takes a hold or a list */
+#define cas_rel(dst, old, new) cas_mo (dst, old, new, memory_order_release) /* publishes what was written before */
+#define rfence() atomic_thread_fence (memory_order_acquire) /* loads before it stay before later loads */
+#define wfence() atomic_thread_fence (memory_order_release) /* stores after it stay after earlier ones */
+#define fence() atomic_thread_fence (memory_order_seq_cst) /* a store before it is seen by the loads after */
+#define DIR_MASK ((1 << PW2_DIR_LEAF) - 1)
+/* both directory levels are published by cas_rel in new_mem_dir / new_mem_block */
+#define ip(mp, type, i) (*(type *)((char *) ld_acq (ld_acq ((mp)->dir[(i) >> (mp)->dshift])->blk[((i) >> (mp)->shift) & DIR_MASK]) \
+                                   + (((i) & (mp)->mask) << (mp)->nshift))) /* node_size stride */
 #define i2p(mp, type, i) (i == NNULL ? NULL : &(ip(mp, type, i)))
+#define ctz(m) __builtin_ctz (m)
+#define hash_tag(v) ((nid) ((((v).x ^ (v).y) * 11400714819323198485UL) >> 32) | 1) /* never 0, see SEAT_EMPTY */
 //#define unhold_bucket(hv, v) do { if ((hv).y && !(hv).x) (hv).x = (v).x; } while(0)
-#define unhold_bucket(hv, v) while ((hv).y && !cas (&(hv).x, 0, (v).x))
-#define hold_bucket_otherwise_return_0(hv, v) do { unsigned long __l = MAXSPIN; \
-          while (!cas(&(hv).x, (v).x, 0)) { /* when CAS fails */ \
-            if ((hv).x != (v).x) return 0; /* already released or reused */\
-            while ((hv).x == 0) { /* wait for unhold */ \
-              if ((hv).y == 0) return 0; /* no unhold but released */ \
-              if (--__l == 0) { add1 (h->stats.escapes); return 0; } /* give up */ \
-              if (__l & 0x0f) __asm__("pause"); else sched_yield(); /*alt: usleep(1)*/ \
-          }} \
-          if ((hv).y != (v).y || (hv).y == 0) { unhold_bucket (hv, v); return 0; } \
+/* unhold is seq_cst, not only release: unpark then reads h->parked, which
+ * a waiter counted before it read x (see hold_wait) */
+#define unhold_bucket(hv, v) do { while (ld ((hv).y) && !cas (&(hv).x, 0, (v).x)); unpark (h, &(hv).x); } while (0)
+#define hold_bucket_otherwise_return_0(hv, v) do { unsigned long __t = 0; \
+          while (!cas_acq (&(hv).x, (v).x, 0)) { /* when CAS fails */ \
+            if (ld ((hv).x) != 0 && ld ((hv).x) != (v).x) return 0; /* reused */ \
+            if (ld ((hv).y) == 0) return 0; /* released, x left 0 */ \
+            if (ld ((hv).x) == 0 && !hold_wait (h, &(hv).x, &__t)) return 0; /* gave up */ \
+          } \
+          if (ld ((hv).y) != (v).y || ld ((hv).y) == 0) { unhold_bucket (hv, v); return 0; } \
+          } while (0)
+
+/* HASH_SMALL: pooled nodes are snode_t, holding the low halves of hv */
+#define small(h) ((h)->flags & HASH_SMALL)
+#define sn(p) ((snode_t *) (p))
+#define small_hv(v) ((hv) { .x = (nid) (v).x, .y = (nid) (v).y })
+#define node_hv(h, p) (small (h) ? (hv) { .x = ld (sn (p)->x), .y = ld (sn (p)->y) } \
+                       : (hv) { .x = ld ((p)->v.x), .y = ld ((p)->v.y) })
+#define node_data(h, p) (small (h) ? (void *) (uintptr_t) ld (sn (p)->data) : ld ((p)->data))
+#define node_hold_x(h, p, hx) (small (h) ? cas_acq (&sn (p)->x, (nid) (hx), 0) : cas_acq (&(p)->v.x, (hx), 0))
+#define node_set_x(h, p, hx) do { if (small (h)) st_rel (sn (p)->x, (nid) (hx)); else st_rel ((p)->v.x, (hx)); } while (0)
+/* the version of a node_t is odd from release until it is filled again,
+ * so a HASH_OPTREAD get that saw it even and unchanged read a stable node */
+#define EXPIRE_MS(e) ((e) & ((1UL << VER_SHIFT) - 1))
+#define ver_odd(e) (((e) >> VER_SHIFT) & 1)
+#define ver_released(e) ((((e) >> VER_SHIFT) | 1) << VER_SHIFT)
+#define ver_filled(e) (((((e) >> VER_SHIFT) | 1) + 1) << VER_SHIFT)
+#define hold_node_otherwise_return_0(h, p, w) do { if (small (h)) { hv __w = small_hv (w); \
+          hold_bucket_otherwise_return_0 (*sn (p), __w); } else hold_bucket_otherwise_return_0 ((p)->v, w); \
           } while (0)
+#define unhold_node(h, p, w) do { if (small (h)) { hv __w = small_hv (w); unhold_bucket (*sn (p), __w); } \
+          else unhold_bucket ((p)->v, w); } while (0)
+
+
+/* a node held (x == 0) is waited for with pauses, in rounds growing to
+ * HOLD_BACKOFF, for h->spin pauses; then the waiter parks on a futex of x
+ * (its first 32 bits, 0 as well), 1ms a round for up to h->park_ms. Holders
+ * wake x when they unhold or release it and h->parked of x counts waiters.
+ * w: pauses and rounds parked so far by this hold. return 0 to give up */
+#define park_slot(h, x) (&(h)->parked[((uintptr_t) (x) >> 5) * 11400714819323198485UL >> (64 - PARK_BITS)])
+#define unpark(h, x) do { if (__atomic_load_n (park_slot (h, x), memory_order_seq_cst)) \
+          syscall (SYS_futex, (void *) (x), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0); } while (0)
+
+static int
+hold_wait (hash_t *h, volatile void *x, unsigned long *w)
+{
+  volatile int *c;
+  unsigned long i, b;
+  struct timespec ts = { 0, 1000000 };
+  if (*w < h->spin)
+    {
+      b = *w == 0 ? 1 : (*w < HOLD_BACKOFF ? *w : HOLD_BACKOFF);
+      for (i = 0; i < b && ld (*(uint32_t *) x) == 0; i++)
+        __asm__("pause");
+      *w += b;
+      return 1;
+    }
+  if ((*w)++ >= h->spin + h->park_ms)
+    {
+      add1 (h->stats.escapes);
+      return 0;
+    }
+  c = park_slot (h, x);
+  atomic_add1 (*c); /* counted before x is checked, seen by the holder after it set x */
+  if (ld (*(uint32_t *) x) == 0)
+    {
+      add1 (h->stats.parks);
+      syscall (SYS_futex, (void *) x, FUTEX_WAIT_PRIVATE, 0, &ts, NULL, 0);
+    }
+  atomic_sub1 (*c);
+  return 1;
+}
+
+/* a thread counts ops in its own shard of hc_t, taken in turn at its first op */
+static __thread unsigned int thread_shard = NSHARD; /* NSHARD: none taken yet */
+static unsigned int shard_next;
 
+static inline hc_t *
+shard (hash_t *h)
+{
+  if (thread_shard == NSHARD)
+    thread_shard = add1 (shard_next) % NSHARD;
+  return &h->hc[thread_shard];
+}
+#define count(h, f) do { if (!((h)->flags & HASH_NOSTATS)) add1 (shard (h)->f); } while (0)
+/* keys in use, kept by HASH_NOSTATS: the stash count is read by every probe */
+#define count_cur(h, idx, d) do { if ((idx) == NMHT) addn ((h)->ht[NMHT].ncur, d); \
+          else addn (shard (h)->ncur[idx], d); } while (0)
 
-inline unsigned long
+static inline unsigned long
 nowms ()
 {
   struct timeval tv;
@@ -79,113 +231,461 @@ nowms ()
   return (tv.tv_sec * 1000 + tv.tv_usec / 1000);
 }
 
+/* zeroed pages of their own mapping, committed as they are written and open
+ * to a policy of their own (HASH_NUMA) */
+static void *
+plain_map (unsigned long size)
+{
+  void *p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* the default allocator maps sizes from MAP_MIN up */
+static void *
+default_alloc (void *ctx, size_t size, size_t align, int node)
+{
+  void *p;
+  if (size >= MAP_MIN)
+    return plain_map (size);
+  if (posix_memalign (&p, align < sizeof (void *) ? sizeof (void *) : align, size))
+    return NULL;
+  return p;
+}
+
+static void
+default_free (void *ctx, void *p, size_t size)
+{
+  if (size >= MAP_MIN)
+    munmap (p, size);
+  else
+    free (p);
+}
+
+/* memory of a hash from its allocator, zeroed if zero. Zeroed memory of the
+ * default one is mapped or from calloc, untouched pages stay uncommitted */
+static void *
+mem_alloc (hash_mem_t * m, unsigned long size, unsigned long align, int node, int zero)
+{
+  void *p;
+  if (!m->user && zero && align <= 16 && size < MAP_MIN)
+    p = calloc (1, size);
+  else if ((p = m->a.alloc (m->a.ctx, size, align, node)) && zero && (m->user || size < MAP_MIN))
+    memset (p, 0, size);
+  if (p)
+    addn (m->bytes, size);
+  return p;
+}
+
+static void
+mem_free (hash_mem_t * m, void *p, unsigned long size)
+{
+  if (!p)
+    return;
+  m->a.free (m->a.ctx, p, size);
+  subn (m->bytes, size);
+}
+
+/* HASH_HUGEPAGE: map *size bytes on hugetlb pages (1GB ones from 1GB up, else
+ * 2MB), or if none are reserved on 2MB aligned normal pages advised for THP.
+ * *size is rounded up to the pages, *kind set to 2 for hugetlb, 1 for THP.
+ * return zeroed memory, NULL if none */
+static void *
+huge_map (unsigned long *size, unsigned long *kind)
+{
+  int f = MAP_PRIVATE | MAP_ANONYMOUS;
+  unsigned long sz;
+  char *p, *q;
+  if (*size >= HUGE_1G)
+    {
+      sz = (*size + HUGE_1G - 1) & ~(HUGE_1G - 1);
+      if ((p = mmap (NULL, sz, PROT_READ | PROT_WRITE, f | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0)) != MAP_FAILED)
+        goto hugetlb;
+    }
+  sz = (*size + HUGE_2M - 1) & ~(HUGE_2M - 1);
+  if ((p = mmap (NULL, sz, PROT_READ | PROT_WRITE, f | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0)) != MAP_FAILED)
+    goto hugetlb;
+  if ((p = mmap (NULL, sz + HUGE_2M, PROT_READ | PROT_WRITE, f, -1, 0)) == MAP_FAILED)
+    return NULL;
+  q = (char *) (((unsigned long) p + HUGE_2M - 1) & ~(HUGE_2M - 1));
+  if (q > p)
+    munmap (p, q - p);
+  munmap (q + sz, p + HUGE_2M - q);
+  madvise (q, sz, MADV_HUGEPAGE);
+  *size = sz;
+  *kind = 1;
+  return q;
+hugetlb:
+  *size = sz;
+  *kind = 2;
+  return p;
+}
+
+/* HASH_NUMA: mask of the numa nodes with memory, 1 if not known */
+static unsigned long
+numa_nodes (void)
+{
+  unsigned long mask = 0, a, b;
+  int c = ',';
+  FILE *f;
+  if (!(f = fopen ("/sys/devices/system/node/has_memory", "r")))
+    return 1;
+  while (c == ',' && fscanf (f, "%lu", &a) == 1)
+    {
+      b = a;
+      if ((c = fgetc (f)) == '-' && fscanf (f, "%lu", &b) == 1)
+        c = fgetc (f);
+      for (; a <= b && a < NUMA_MAX; a++)
+        mask |= 1UL << a;
+    }
+  fclose (f);
+  return mask ? mask : 1;
+}
+
+/* HASH_NUMA: pages of p not touched yet go to the nodes of mask, spread by
+ * MPOL_INTERLEAVE or to one by MPOL_PREFERRED. A failure only costs locality */
+static void
+numa_bind (void *p, unsigned long size, int mode, unsigned long mask)
+{
+  syscall (SYS_mbind, p, size, mode, &mask, NUMA_MAX + 1, 0);
+}
+
 mem_pool_t *
-create_mem_pool (unsigned int max_nodes, unsigned int node_size)
+create_mem_pool (unsigned int max_nodes, unsigned int node_size, int huge, int numa, hash_mem_t * m)
 {
   unsigned int pwr2_max_nodes, pwr2_node_size, pwr2_total_size, pwr2_block_size;
   mem_pool_t *pmp;
 
-#define PW2_MAX_BLK_PTR 9   /* hard code one 4K-page for max 512 block pointers */
+#define PW2_BLK_PER_POOL 9  /* blocks for max_nodes, unless block size is clamped below */
 #define PW2_MIN_BLK_SIZ 12  /* 2^12 = 4K page size */
+#define PW2_MAX_BLK_SIZ 21  /* 2MB, larger pools take more blocks */
 
   for (pwr2_max_nodes = 0; (1 << pwr2_max_nodes) < max_nodes; pwr2_max_nodes++);
-  if (pwr2_max_nodes == 0 || pwr2_max_nodes > 32) /* auto resize for exceeption, use 1MB as mem index and 1MB block size*/
+  if (pwr2_max_nodes == 0 || pwr2_max_nodes > 32) /* auto resize for exceeption */
     pwr2_max_nodes = 32;
 
   for (pwr2_node_size = 0; (1 << pwr2_node_size) < node_size; pwr2_node_size++);
-  if ((1 << pwr2_node_size) != node_size || pwr2_node_size < 5 || pwr2_node_size > 12)
+  if ((1 << pwr2_node_size) != node_size || pwr2_node_size < 4 || pwr2_node_size > 12)
     {
-      printf("node_size should be N powe of 2, 5 <= N <= 12(4KB page)");
+      printf("node_size should be N powe of 2, 4 <= N <= 12(4KB page)");
       return NULL;
     }
 
-  if (posix_memalign ((void **) (&pmp), 64, sizeof (*pmp)))
+  if (!(pmp = mem_alloc (m, sizeof (*pmp), 64, HASH_NODE_ANY, 1)))
     return NULL;
-  memset (pmp, 0, sizeof (*pmp));
+  pmp->mem = m;
 
   pwr2_total_size = pwr2_max_nodes + pwr2_node_size;
-  if (pwr2_total_size <= PW2_MAX_BLK_PTR + PW2_MIN_BLK_SIZ)
+  if (pwr2_total_size <= PW2_BLK_PER_POOL + PW2_MIN_BLK_SIZ)
     pwr2_block_size = PW2_MIN_BLK_SIZ;
+  else if (pwr2_total_size >= PW2_BLK_PER_POOL + PW2_MAX_BLK_SIZ)
+    pwr2_block_size = PW2_MAX_BLK_SIZ;
   else
-    pwr2_block_size = pwr2_total_size - PW2_MAX_BLK_PTR;
+    pwr2_block_size = pwr2_total_size - PW2_BLK_PER_POOL;
+  if (huge) /* one 2MB page per block */
+    pwr2_block_size = PW2_MAX_BLK_SIZ;
+  pmp->huge = huge;
+  pmp->numa = numa;
+  pmp->mapped = !m->user && (huge || numa); /* a caller's allocator places blocks itself */
 
-  pmp->max_blocks = (nid) (1 << (PW2_MAX_BLK_PTR));
   pmp->node_size = (nid) (1 << pwr2_node_size);
   pmp->blk_size = (nid) (1 << pwr2_block_size);
   pmp->blk_node_num = (nid) (1 << (pwr2_block_size - pwr2_node_size));
   pmp->shift = (nid) pwr2_block_size - pwr2_node_size;
+  pmp->dshift = pmp->shift + PW2_DIR_LEAF;
+  pmp->nshift = pwr2_node_size;
   pmp->mask = (nid) ((1 << pmp->shift) - 1);
+  pmp->max_blocks = (nid) ((1UL << (32 - pmp->shift)) - 1); /* all nids but NNULL */
+  pmp->ndir = (pmp->max_blocks >> PW2_DIR_LEAF) + 1;
   pmp->curr_blocks = 0;
 
-  if (!posix_memalign ((void **) (&pmp->ba), 64, pmp->max_blocks * sizeof (*pmp->ba)))
+  /* untouched pages of the root stay unmapped, leaves come with blocks */
+  if ((pmp->dir = mem_alloc (m, pmp->ndir * sizeof (*pmp->dir), sizeof (void *), HASH_NODE_ANY, 1)))
+    return pmp;
+  mem_free (m, pmp, sizeof (*pmp));
+  return NULL;
+}
+
+static void
+free_mem_block (mem_pool_t * pmp, void *p)
+{
+  if (!pmp->mapped)
+    mem_free (pmp->mem, p, pmp->blk_size);
+  else
     {
-      memset (pmp->ba, 0, pmp->max_blocks * sizeof (*pmp->ba));
-      return pmp;
+      munmap (p, pmp->blk_size);
+      subn (pmp->mem->bytes, pmp->blk_size);
     }
-  free (pmp);
-  return NULL;
 }
 
 
 int
 destroy_mem_pool (mem_pool_t * pmp)
 {
-  unsigned long i;
+  unsigned long i, j;
   if (!pmp)
     return -1;
-  for (i = 0; i < pmp->max_blocks; i++)
-    if (pmp->ba[i])
+  for (i = 0; i < pmp->ndir; i++)
+    if (pmp->dir[i])
       {
-	free (pmp->ba[i]);
-	pmp->ba[i] = NULL;
-	pmp->curr_blocks--;
+        for (j = 0; j < (1 << PW2_DIR_LEAF); j++)
+          if (pmp->dir[i]->blk[j])
+            {
+              free_mem_block (pmp, pmp->dir[i]->blk[j]);
+              pmp->curr_blocks--;
+            }
+        mem_free (pmp->mem, pmp->dir[i], sizeof (mem_dir_t));
+        pmp->dir[i] = NULL;
       }
-  free (pmp->ba);
-  pmp->ba = NULL;
-  free (pmp);
+  mem_free (pmp->mem, (void *) pmp->dir, pmp->ndir * sizeof (*pmp->dir));
+  pmp->dir = NULL;
+  mem_free (pmp->mem, pmp, sizeof (*pmp));
   return 0;
 }
 
-inline nid *
-new_mem_block (mem_pool_t * pmp, volatile cas_t * recv_queue)
+/* block b or NULL, safe for any b read from a stale link */
+static inline void *
+mem_block (mem_pool_t * pmp, nid b)
+{
+  mem_dir_t *d;
+  if (b >= pmp->max_blocks || !(d = ld_acq (pmp->dir[b >> PW2_DIR_LEAF])))
+    return NULL;
+  return ld_acq (d->blk[b & DIR_MASK]);
+}
+
+static mem_dir_t *
+new_mem_dir (mem_pool_t * pmp, nid b)
+{
+  mem_dir_t *d;
+  if (!(d = mem_alloc (pmp->mem, sizeof (*d), 64, HASH_NODE_ANY, 1)))
+    return NULL;
+  if (!cas_rel (&pmp->dir[b >> PW2_DIR_LEAF], NULL, d))
+    mem_free (pmp->mem, d, sizeof (*d)); /* other thread wins */
+  return ld_acq (pmp->dir[b >> PW2_DIR_LEAF]);
+}
+
+/* k: numa node of the block if HASH_NUMA */
+static inline nid *
+new_mem_block (mem_pool_t * pmp, volatile cas_t * recv_queue, unsigned int k)
 {
-  nid i, m, sz, sft, head = 0;
+  nid i, m, sz, head = 0;
   memword cas_t n, x, *pn;
-  void *p;
+  mem_dir_t *d = NULL;
+  void *p = NULL;
+  unsigned long msz = pmp ? pmp->blk_size : 0, kind = 0;
 
-  if (!pmp || !(p = calloc (pmp->blk_node_num, pmp->node_size)))
+  if (!pmp)
     return NULL;
-  for (i = pmp->curr_blocks; i < pmp->max_blocks; i++)
-    if (cas (&pmp->ba[i], NULL, p))
-      {
-        atomic_add1 (pmp->curr_blocks);
-        break;
-      }
-  if (i == pmp->max_blocks)
+  if (ld (pmp->rel_blocks) > 0) /* a block given back to the OS comes first */
+    for (i = 0; i < ld (pmp->curr_blocks); i++)
+      if ((d = ld_acq (pmp->dir[i >> PW2_DIR_LEAF])) && ld (d->rel[i & DIR_MASK])
+          && (!pmp->numa || ld (d->node[i & DIR_MASK]) == k) && cas_acq (&d->rel[i & DIR_MASK], 1, 0))
+        {
+          subn (pmp->rel_blocks, 1);
+          p = ld (d->blk[i & DIR_MASK]);
+          break;
+        }
+  if (!p)
     {
-      free (p);
-      return NULL;
+      /* page aligned, so an idle block can be returned by madvise */
+      if (!pmp->mapped)
+        {
+          if (!(p = mem_alloc (pmp->mem, pmp->blk_size, 4096, pmp->numa ? (int) k : HASH_NODE_ANY, 1)))
+            return NULL;
+        }
+      else if (!(p = pmp->huge ? huge_map (&msz, &kind) : plain_map (msz)))
+        return NULL;
+      else
+        {
+          addn (pmp->mem->bytes, msz);
+          if (pmp->numa) /* before the links fault its pages in */
+            numa_bind (p, msz, MPOL_PREFERRED, 1UL << k);
+        }
+      for (i = ld (pmp->curr_blocks); i < pmp->max_blocks; i++)
+        if (!(d = ld_acq (pmp->dir[i >> PW2_DIR_LEAF])) && !(d = new_mem_dir (pmp, i)))
+          i = pmp->max_blocks - 1; /* no memory */
+        else if (cas_rel (&d->blk[i & DIR_MASK], NULL, p))
+          {
+            add1 (pmp->curr_blocks); /* readers of the block find it by d->blk */
+            if (kind == 2)
+              add1 (pmp->hugetlb_blocks);
+            st (d->node[i & DIR_MASK], k);
+            break;
+          }
+      if (i == pmp->max_blocks)
+        {
+          free_mem_block (pmp, p);
+          return NULL;
+        }
     }
+  st (d->nfree[i & DIR_MASK], pmp->blk_node_num); /* all pushed below */
   sz = pmp->node_size;
-  sft = pmp->shift;
   m = pmp->mask;
   head = i * (m + 1);
   for (i = 0; i < m; i++)
-    *(nid *) (p + i * sz) = head + i + 1;
+    st (*(nid *) (p + i * sz), head + i + 1); /* a reused block may still be read by stale links */
   pn = (cas_t *) (p + m * sz);
-  pn->mi = NNULL;
-  pn->rfn = 0;
+  st (pn->rfn, 0);
   x.mi = head;
   do
     {
-      n.all = recv_queue->all;
-      pn->mi = n.mi;
+      n.all = ld (recv_queue->all);
+      st (pn->mi, n.mi);
       x.rfn = n.rfn + 1;
     }
-  while (!cas (&recv_queue->all, n.all, x.all));
+  while (!cas_rel (&recv_queue->all, n.all, x.all));
   return (nid *) (p + m * sz);
 }
 
+/* mark for release the blocks whose nodes are all in the free lists by their
+ * free counts, while more than keep nodes and one block would stay free.
+ * Up to num blocks are visited, from *cur on. A marked block leaves the free
+ * lists node by node as its nodes are popped or swept, see retire_node.
+ * return # of blocks marked */
+static unsigned int
+trim_mem_pool (mem_pool_t * pmp, unsigned long nfree, unsigned long keep, unsigned long *cur, unsigned long num)
+{
+  nid b, nb = ld (pmp->curr_blocks), nn = pmp->blk_node_num;
+  unsigned int nmark = 0;
+  mem_dir_t *d;
+
+  for (b = *cur; nb > 0 && num > 0 && nfree >= keep + nn; b++, num--)
+    {
+      if (b >= nb)
+        b = 0;
+      d = ld_acq (pmp->dir[b >> PW2_DIR_LEAF]);
+      if (!d || !ld (d->blk[b & DIR_MASK]) || ld (d->rel[b & DIR_MASK]) || ld (d->nfree[b & DIR_MASK]) < nn)
+        continue;
+      st (d->left[b & DIR_MASK], nn);
+      atomic_add1 (pmp->drain_blocks); /* frees look at rel once it is set */
+      st_rel (d->rel[b & DIR_MASK], 3);
+      nfree -= nn;
+      nmark++;
+    }
+  *cur = b;
+  return nmark;
+}
+
+/* a node of a draining or trimmed block is never freed or popped again but
+ * counted down here, the last one gives the block back to the OS. Released
+ * blocks stay mapped for late readers of stale links and are reused first by
+ * new_mem_block.
+ * return 0 if its block is neither, 1 if retired, else the rel of the block
+ * it released: 2 drained, 3 trimmed */
+static inline int
+retire_node (mem_pool_t * pmp, nid mi)
+{
+  nid b = mi >> pmp->shift;
+  mem_dir_t *d = ld_acq (pmp->dir[b >> PW2_DIR_LEAF]);
+  int r = ld_acq (d->rel[b & DIR_MASK]);
+  if (r < 2)
+    return 0;
+  if (__atomic_sub_fetch (&d->left[b & DIR_MASK], 1, memory_order_acq_rel) > 0)
+    return 1;
+  madvise (ld (d->blk[b & DIR_MASK]), pmp->blk_size, MADV_DONTNEED);
+  st_rel (d->rel[b & DIR_MASK], 1);
+  atomic_add1 (pmp->rel_blocks);
+  atomic_sub1 (pmp->drain_blocks);
+  return r;
+}
+
+/* mark sparse blocks for draining (HASH_COMPACT) by their free counts, from
+ * block *cur down, while the other blocks have room for their live nodes.
+ * Up to num blocks are visited. Every node of a draining block is retired
+ * once, as for a trimmed block: a free one when it is popped or swept, a
+ * live one when it is freed or moved; the last one releases the block.
+ * return # of blocks marked */
+static unsigned int
+drain_mem_pool (mem_pool_t * pmp, unsigned long nfree, unsigned long *cur, unsigned long num)
+{
+  nid b, nf, nb = ld (pmp->curr_blocks), nn = pmp->blk_node_num;
+  unsigned long nlive = 0;
+  unsigned int nmark = 0;
+  mem_dir_t *d;
+
+  for (b = *cur; nb > 0 && num > 0; num--)
+    {
+      b = (b == 0 || b > nb) ? nb - 1 : b - 1;
+      d = ld_acq (pmp->dir[b >> PW2_DIR_LEAF]);
+      if (!d || !ld (d->blk[b & DIR_MASK]) || ld (d->rel[b & DIR_MASK]))
+        continue;
+      if ((nf = ld (d->nfree[b & DIR_MASK])) > nn || nn - nf > nn / COMPACT_SPARSE)
+        continue;
+      if (nfree - nf < nlive + nn - nf + nn)
+        break; /* no room left in the other blocks */
+      nfree -= nf;
+      nlive += nn - nf;
+      st (d->left[b & DIR_MASK], nn);
+      atomic_add1 (pmp->drain_blocks); /* frees look at rel once it is set */
+      st_rel (d->rel[b & DIR_MASK], 2);
+      nmark++;
+    }
+  *cur = b;
+  return nmark;
+}
+
+/* free list of numa node k on side s, see pool_sweep */
+static inline volatile cas_t *
+free_list (hash_t *h, unsigned int k, unsigned long s)
+{
+  return k || s ? &h->nfl[(2 * k + s) << 3] : &h->freelist;
+}
+#define node_list(h, k) free_list (h, k, ld ((h)->fside)) /* the one nodes are freed to */
+
+/* free nodes of the pool, counting those in thread magazines */
+static inline unsigned long
+pool_free (hash_t *h)
+{
+  mem_pool_t *mp = h->mp;
+  unsigned long navail, nused, j;
+  navail = (unsigned long) (ld (mp->curr_blocks) - ld (mp->rel_blocks)) * mp->blk_node_num;
+  nused = ld (h->ht[NMHT].ncur);
+  if (!(h->flags & HASH_INLINE))
+    for (j = 0; j < NSHARD; j++)
+      nused += ld (h->hc[j].ncur[0]) + ld (h->hc[j].ncur[1]);
+  return navail > nused ? navail - nused : 0;
+}
+
+/* add blocks until num nodes are free, their pages are faulted in by the links */
+static int
+pool_top_up (hash_t *h, unsigned long num)
+{
+  unsigned int k;
+  while (pool_free (h) < num)
+    {
+      k = ld (h->mp->curr_blocks) % h->nnuma; /* HASH_NUMA: round robin */
+      if (!new_mem_block (h->mp, node_list (h, k), k))
+        return -1;
+    }
+  return 0;
+}
+
+int
+atomic_hash_reserve (hash_t *h, unsigned long num)
+{
+  if (!h)
+    return -1;
+  st (h->reserve, num);
+  return pool_top_up (h, num);
+}
+
+static void pool_step (hash_t *h, unsigned long now);
+
+/* HASH_PREALLOC: keeps h->reserve nodes free, so adds rarely allocate, and
+ * runs the pool steps of HASH_ELASTIC and HASH_COMPACT while no op does */
+static void *
+prealloc_thread (void *arg)
+{
+  hash_t *h = (hash_t *) arg;
+  while (!ld (h->prealloc_stop))
+    {
+      pool_top_up (h, ld (h->reserve));
+      if (h->flags & (HASH_ELASTIC | HASH_COMPACT))
+        pool_step (h, nowms ());
+      usleep (PREALLOC_US);
+    }
+  return NULL;
+}
+
 int default_func_reset_ttl (void *hash_data, void *return_data)
 {
   if (return_data)
@@ -208,8 +708,26 @@ int default_func_remove_node (void *hash_data, void *return_data)
   return PLEASE_REMOVE_HASH_NODE;
 }
 
+static void
+free_htab (htab_t * ht, hash_mem_t * m)
+{
+  if (!ht->b)
+    return;
+  if (!ht->mkind)
+    mem_free (m, ht->b, ht->msize);
+  else
+    {
+      munmap (ht->b, ht->msize);
+      subn (m->bytes, ht->msize);
+    }
+}
+
+/* slot_size: sizeof (seat_t), or sizeof (node_t) for HASH_INLINE arrays;
+ * mode: HASH_HUGEPAGE maps the array by huge_map, HASH_NUMA interleaves its
+ * pages; with a caller's allocator they are hints to it. Zeroed pages are empty
+ * seats and free inline nodes, so an array of fresh pages is committed as it is written */
 int
-init_htab (htab_t * ht, unsigned long num, double ratio)
+init_htab (htab_t * ht, unsigned long num, double ratio, unsigned long slot_size, int mode, hash_mem_t * m)
 {
   unsigned long i, nb;
   double r;
@@ -217,12 +735,27 @@ init_htab (htab_t * ht, unsigned long num, double ratio)
   for (i = 134217728; nb > i; i *= 2);
 //  nb = (nb >= 134217728) ? i : nb; // improve folding for more than 1/32 of MAXTAB (2^32)
   ht->nb = (i > MAXTAB) ? MAXTAB : ((nb < MINTAB) ? MINTAB : nb);
+  ht->ng = (ht->nb + NGSEAT - 1) / NGSEAT;
+  ht->nb = ht->ng * NGSEAT; /* round up to whole groups */
   ht->n = num; //if 3rd tab: n <- 0, nb <- MINTAB, r <- COLLISION
   r = (ht->n == 0 ? ratio : ht->nb * 1.0 / ht->n);
-  if (!(ht->b = calloc (ht->nb, sizeof (*ht->b))))
+  ht->gshift = __builtin_ctzl (NGSEAT * slot_size);
+  ht->msize = ht->nb * slot_size;
+  ht->mkind = 0;
+  if (m->user || !(mode & (HASH_HUGEPAGE | HASH_NUMA)))
+    ht->b = mem_alloc (m, ht->msize, 64, (mode & HASH_NUMA) ? HASH_NODE_INTERLEAVE : HASH_NODE_ANY, 1);
+  else if (mode & HASH_HUGEPAGE)
+    ht->b = huge_map (&ht->msize, &ht->mkind);
+  else if ((ht->b = plain_map (ht->msize)))
+    ht->mkind = 3;
+  if (!ht->b)
     return -1;
-  for (i = 0; i < ht->nb; i++)
-    ht->b[i] = NNULL;
+  if (ht->mkind)
+    {
+      addn (m->bytes, ht->msize);
+      if (mode & HASH_NUMA)
+        numa_bind (ht->b, ht->msize, MPOL_INTERLEAVE, numa_nodes ());
+    }
 #ifdef DEBUG
   printf ("expected nb[%ld] = n[%ld] * r[%f]\n", (unsigned long) (num * ratio),
 	  num, ratio);
@@ -231,22 +764,92 @@ init_htab (htab_t * ht, unsigned long num, double ratio)
   return 0;
 }
 
+typedef struct fault_slice
+{
+  volatile char *p;
+  unsigned long size;
+} fault_slice_t;
+
+/* HASH_PREFAULT: write a 0 (empty seat, free inline node) to every page */
+static void *
+fault_slice (void *arg)
+{
+  fault_slice_t *f = (fault_slice_t *) arg;
+  unsigned long i;
+  for (i = 0; i < f->size; i += 4096)
+    f->p[i] = 0;
+  if (f->size)
+    f->p[f->size - 1] = 0;
+  return NULL;
+}
+
+/* HASH_PREFAULT: fault in an array by up to a thread per cpu */
+static void
+prefault (void *p, unsigned long size)
+{
+  fault_slice_t f[PREFAULT_THREADS];
+  pthread_t t[PREFAULT_THREADS];
+  int run[PREFAULT_THREADS];
+  unsigned long i, n = sysconf (_SC_NPROCESSORS_ONLN), slice;
+  if (n > size / PREFAULT_SLICE)
+    n = size / PREFAULT_SLICE;
+  n = (n < 1) ? 1 : ((n > PREFAULT_THREADS) ? PREFAULT_THREADS : n);
+  slice = (size / n + 4095) & ~4095UL;
+  for (i = 0; i < n; i++)
+    {
+      f[i].p = (char *) p + i * slice;
+      f[i].size = (i * slice >= size) ? 0 : ((size - i * slice < slice) ? size - i * slice : slice);
+      if (i > 0 && !(run[i] = !pthread_create (&t[i], NULL, fault_slice, &f[i])))
+        fault_slice (&f[i]); /* no thread, done here */
+    }
+  fault_slice (&f[0]);
+  for (i = 1; i < n; i++)
+    if (run[i])
+      pthread_join (t[i], NULL);
+}
+
+/* the arrays of h sized at create time, then h */
+static void
+free_hash (hash_t * h)
+{
+  hash_mem_t m;
+  mem_free (&h->mem, (void *) h->nfl, h->nnuma * 128);
+  mem_free (&h->mem, h->ovf, h->ht[0].ng * sizeof (*h->ovf));
+  mem_free (&h->mem, h->mseq, h->ht[0].ng * sizeof (*h->mseq));
+  mem_free (&h->mem, h->bf, h->nbf * 64);
+  mem_free (&h->mem, h->hc, NSHARD * sizeof (hc_t));
+  m = h->mem;
+  mem_free (&m, h, sizeof (*h));
+}
+
 hash_t *
 atomic_hash_create (unsigned int max_nodes, int reset_ttl)
+{
+  return atomic_hash_create_opts (max_nodes, reset_ttl, NULL);
+}
+
+hash_t *
+atomic_hash_create_opts (unsigned int max_nodes, int reset_ttl, const hash_opts_t *opts)
 {
   const double collision = COLLISION;	/* collision control, larger is better */
   hash_t *h;
   htab_t *ht1, *ht2, *at1;	/* bucket array 1, 2 and collision array */
   double K, r1, r2;
-  unsigned long j, n1, n2;
+  unsigned long j, n1, n2, slot;
+  hash_mem_t m = { { default_alloc, default_free, NULL }, 0, 0 };
   if (max_nodes < 2 || max_nodes > MAXTAB)
     {
       printf ("max_nodes range: 2 ~ %ld\n", (unsigned long) MAXTAB);
       return NULL;
     }
-  if (posix_memalign ((void **) (&h), 64, sizeof (*h)))
+  if (opts && opts->alloc)
+    {
+      m.a = *opts->alloc;
+      m.user = 1;
+    }
+  if (!(h = mem_alloc (&m, sizeof (*h), 64, HASH_NODE_ANY, 1)))
     return NULL;
-  memset (h, 0, sizeof (*h));
+  h->mem = m;
 
 
 #if defined (MPQ3HASH)
@@ -272,12 +875,34 @@ atomic_hash_create (unsigned int max_nodes, int reset_ttl)
   h->on_get = default_func_not_change_ttl;
   h->on_dup = default_func_reset_ttl;
   h->reset_expire = reset_ttl;
+  h->flags = opts ? opts->flags : 0;
+  h->pool_low = (opts && opts->pool_low > 0) ? opts->pool_low : POOL_LOW;
+  h->pool_high = (opts && opts->pool_high > 0) ? opts->pool_high : POOL_HIGH;
+  h->spin = (opts && opts->spin > 0) ? opts->spin : HOLD_SPIN;
+  h->park_ms = (opts && opts->park_ms > 0) ? opts->park_ms : HOLD_PARK_MS;
+  if (h->pool_high < h->pool_low)
+    h->pool_high = h->pool_low;
+  if (h->flags & HASH_INLINE)
+    h->flags &= ~(HASH_DISPLACE | HASH_COMPACT | HASH_SMALL); /* inline nodes have no seats to move */
+  if (h->flags & HASH_SMALL)
+    h->flags &= ~HASH_DISPLACE; /* the other groups of a key are found by its whole hv */
+  h->epoch = nowms ();
+  h->prefetch = 1;
   h->nmht = NMHT;
   h->ncmp = NCMP;
   h->nkey = NKEY;		/* uint32_t # of hash function's output */
-  h->npos = h->nkey * NCLUSTER;	/* pos # in one hash table */
+  h->npos = NGROUP * NGSEAT;	/* pos # in one hash table */
   h->nseat = h->npos * h->nmht;	/* pos # in all hash tables */
   h->freelist.mi = NNULL;
+  h->limbo[0].mi = h->limbo[1].mi = h->limbo[2].mi = NNULL;
+  h->gepoch = 1; /* 0 marks a thread out of gets */
+  h->nnuma = 1;
+  if (h->flags & HASH_NUMA)
+    h->nnuma = NUMA_MAX - __builtin_clzl (numa_nodes ());
+  if (!(h->nfl = mem_alloc (&h->mem, h->nnuma * 128, 64, HASH_NODE_ANY, 1))) /* a cache line per list */
+    goto calloc_exit;
+  for (j = 1; j < 2 * h->nnuma; j++)
+    h->nfl[j << 3].mi = NNULL;
 
   ht1 = &h->ht[0];
   ht2 = &h->ht[1];
@@ -285,97 +910,252 @@ atomic_hash_create (unsigned int max_nodes, int reset_ttl)
 /* n1 -> n2 -> 1/tuning
  * nb1 = n1 * r1, r1 = ((n1+2)/tuning/K^2)^(K^2 - 1)
  * nb2 = n2 * r2 == nb1 / K == ((n2+2)/tuning/K))^(K - 1)
+ * K = 9 positions per key (a group is one), so r1 ~ 1.2 and nb2 ~ nb1 / 9:
+ * with 8-byte seats about 10.6 (10^5 keys) to 11.5 (10^8) seat bytes per key,
+ * and 0.6 of ovf counters
 */
+  slot = (h->flags & HASH_INLINE) ? sizeof (node_t) : sizeof (seat_t);
   printf ("init bucket array 1:\n");
-  K = h->npos + 1;
+  K = NGSEAT + 1; /* seats in one group are not independent positions */
   n1 = max_nodes;
   r1 = pow ((n1 * collision / (K * K)), (1.0 / (K * K - 1)));
-  if (init_htab (ht1, n1, r1) < 0)
+  if (h->flags & HASH_DISPLACE)
+    r1 = K / ((K + 1) * DISPLACE_LOAD); /* full groups make room by moving keys, array 1 gets K / (K + 1) of the seats */
+  if (init_htab (ht1, n1, r1, slot, h->flags & (HASH_HUGEPAGE | HASH_NUMA), &h->mem) < 0)
     goto calloc_exit;
 
   printf ("init bucket array 2:\n");
   n2 = (n1 + 2.0) / (K * pow (r1, K - 1));
   r2 = pow (((n2 + 2.0) * collision / K), 1.0 / (K - 1));
-  if (init_htab (ht2, n2, r2) < 0)
+  if (h->flags & HASH_DISPLACE)
+    {
+      n2 = n1 / (K + 1); /* the rest, so nb1 + nb2 = n1 / DISPLACE_LOAD */
+      r2 = 1.0 / DISPLACE_LOAD;
+    }
+  if (init_htab (ht2, n2, r2, slot, h->flags & (HASH_HUGEPAGE | HASH_NUMA), &h->mem) < 0)
     goto calloc_exit;
 
   printf ("init collision array:\n");
-  if (init_htab (at1, 0, collision) < 0)
+  if (init_htab (at1, 0, collision, sizeof (seat_t), 0, &h->mem) < 0)
     goto calloc_exit;
+  h->stash[0] = at1->b; /* more levels are added by stash_grow */
+  if (h->flags & HASH_PREFAULT)
+    for (j = 0; j < NMHT; j++)
+      prefault (h->ht[j].b, h->ht[j].msize);
 
-  h->mp = create_mem_pool (max_nodes, sizeof (node_t));
+  /* HASH_INLINE: pooled nodes are for the collision array only */
+  h->mp = create_mem_pool ((h->flags & HASH_INLINE) ? MINTAB : max_nodes,
+                           small (h) ? sizeof (snode_t) : sizeof (node_t), h->flags & HASH_HUGEPAGE,
+                           (h->flags & HASH_NUMA) ? h->nnuma : 0, &h->mem);
 //  h->mp = old_create_mem_pool (ht1->nb + ht2->nb + at1->nb, sizeof (node_t), max_blocks);
+  if (!h->mp)
+    goto calloc_exit;
   printf ("shift=%d; mask=%d\n", h->mp->shift, h->mp->mask);
   printf ("mem_blocks:\t%d/%d, %dx%d bytes, %d bytes per block\n", h->mp->curr_blocks, h->mp->max_blocks,
           h->mp->blk_node_num, h->mp->node_size, h->mp->blk_size);
-  if (!h->mp)
+
+  if (!(h->ovf = mem_alloc (&h->mem, ht1->ng * sizeof (*h->ovf), 64, HASH_NODE_ANY, 1)))
+    goto calloc_exit;
+  if ((h->flags & (HASH_DISPLACE | HASH_COMPACT))
+      && !(h->mseq = mem_alloc (&h->mem, ht1->ng * sizeof (*h->mseq), 64, HASH_NODE_ANY, 1)))
+    goto calloc_exit;
+  if (!(h->hc = mem_alloc (&h->mem, NSHARD * sizeof (hc_t), 64, HASH_NODE_ANY, 1)))
     goto calloc_exit;
 
-  h->stats.max_nodes = h->mp->max_blocks * h->mp->blk_node_num;
-  h->stats.mem_htabs = ((ht1->nb + ht2->nb) * sizeof (nid)) >> 10;
+  j = h->mp->blk_node_num;
+  h->stats.max_nodes = (((h->flags & HASH_INLINE) ? MINTAB : max_nodes) + j - 1) / j * j;
+  h->stats.mem_htabs = ((ht1->nb + ht2->nb) * slot + at1->nb * sizeof (seat_t)
+                        + ht1->ng * (sizeof (*h->ovf) + (h->mseq ? sizeof (*h->mseq) : 0))) >> 10;
   h->stats.mem_nodes = (h->stats.max_nodes * h->mp->node_size) >> 10;
+  for (j = 0; j < NMHT; j++)
+    if (h->ht[j].mkind == 2)
+      h->stats.mem_hugetlb += h->ht[j].msize >> 10;
+    else if (h->ht[j].mkind == 1)
+      h->stats.mem_thp += h->ht[j].msize >> 10;
+  if (h->flags & HASH_INLINE)
+    h->stats.mem_nodes = (MINTAB * h->mp->node_size) >> 10;
+
+  if (h->flags & HASH_BLOOM)
+    {
+      h->nbf = ((unsigned long) max_nodes * BF_PER_KEY + 127) / 128;
+      if (!(h->bf = mem_alloc (&h->mem, h->nbf * 64, 64, HASH_NODE_ANY, 1)))
+        goto calloc_exit;
+      h->stats.mem_bloom = (h->nbf * 64) >> 10;
+      printf ("bloom filter:	%ld blocks, %.2f MB\n", h->nbf, h->nbf * 64 / 1048576.0);
+    }
+
+  if (h->flags & HASH_PREALLOC)
+    {
+      h->reserve = (opts->reserve > 0) ? opts->reserve : h->stats.max_nodes / RESERVE_DIV;
+      if (h->reserve < RESERVE_MIN_BLOCKS * h->mp->blk_node_num)
+        h->reserve = RESERVE_MIN_BLOCKS * h->mp->blk_node_num;
+      if (pool_top_up (h, h->reserve) < 0 || pthread_create (&h->prealloc_tid, NULL, prealloc_thread, h))
+        goto calloc_exit;
+    }
   return h;
 
 calloc_exit:
-  for (j = 0; j < h->nmht; j++)
-    if (h->ht[j].b)
-      free (h->ht[j].b);
+  for (j = 0; j <= h->nmht; j++)
+    free_htab (&h->ht[j], &h->mem);
   destroy_mem_pool (h->mp);
-  free (h);
+  free_hash (h);
   return NULL;
 }
 
+int
+atomic_hash_snapshot (hash_t *h, hash_snapshot_t *s)
+{
+  hc_t *c;
+  unsigned int j, k;
+  if (!h || !s)
+    return -1;
+  memset (s, 0, sizeof (*s));
+  for (j = 0; j < NSHARD && (c = &h->hc[j]); j++)
+    {
+      for (k = 0; k <= NMHT; k++)
+        {
+          if (k < NMHT)
+            s->ncur[k] += ld (c->ncur[k]);
+          s->nadd[k] += ld (c->nadd[k]);
+          s->ndup[k] += ld (c->ndup[k]);
+          s->nget[k] += ld (c->nget[k]);
+          s->ndel[k] += ld (c->ndel[k]);
+        }
+      s->get_nohit += ld (c->get_nohit);
+      s->del_nohit += ld (c->del_nohit);
+      s->expires += ld (c->expires);
+      s->bloom_neg += ld (c->bloom_neg);
+      s->bloom_fp += ld (c->bloom_fp);
+    }
+  s->ncur[NMHT] = ld (h->ht[NMHT].ncur);
+  for (k = 0; k <= NMHT; k++) /* the counters the shards replaced, for old callers */
+    {
+      if (k < NMHT)
+        st (h->ht[k].ncur, s->ncur[k]);
+      st (h->ht[k].nadd, s->nadd[k]);
+      st (h->ht[k].ndup, s->ndup[k]);
+      st (h->ht[k].nget, s->nget[k]);
+      st (h->ht[k].ndel, s->ndel[k]);
+    }
+  st (h->stats.get_nohit, s->get_nohit);
+  st (h->stats.del_nohit, s->del_nohit);
+  st (h->stats.expires, s->expires);
+  st (h->stats.bloom_neg, s->bloom_neg);
+  st (h->stats.bloom_fp, s->bloom_fp);
+  for (j = 0; j < sizeof (hstats_t) / sizeof (unsigned long); j++) /* word by word: ops count meanwhile */
+    ((unsigned long *) &s->stats)[j] = ld (((unsigned long *) &h->stats)[j]);
+  return 0;
+}
+
 int
 atomic_hash_stats (hash_t * h, unsigned long escaped_milliseconds)
 {
-  const hstats_t *t = &h->stats;
+  hash_snapshot_t snap, *c = &snap;
+  mag_t *g;
+  const hstats_t *t = &snap.stats;
   const htab_t *ht1 = &h->ht[0], *ht2 = &h->ht[1];
-  htab_t *p;
   mem_pool_t *m = h->mp;
-  unsigned long j, nadd, ndup, nget, ndel, nop, ncur, op = 0;
+  unsigned long j, k, nblk, nadd, ndup, nget, ndel, nop, ncur, rss = 0, ahp = 0, op = 0;
+  char line[128];
+  FILE *f;
   double blk_in_kB, mem, d = 1024.0;
   char *b = "    ";
+  atomic_hash_snapshot (h, c);
   blk_in_kB = m->blk_size / d;
-  mem = m->curr_blocks * blk_in_kB;
+  mem = (ld (m->curr_blocks) - ld (m->rel_blocks)) * blk_in_kB;
 #ifdef DEBUG
   printf ("mem=%.2f, blk_in_kB=%.2f, curr_block=%u, blk_nod_num=%u, node_size=%u\n",
            mem, blk_in_kB, m->curr_blocks, m->blk_node_num, m->node_size);
 #endif
   printf ("\n");
-  printf ("mem_blocks:\t%u/%u, %ux%u bytes, %.2f MB per block\n", m->curr_blocks, m->max_blocks,
+  printf ("mem_blocks:\t%u/%u, %ux%u bytes, %.2f MB per block\n", ld (m->curr_blocks), m->max_blocks,
           m->blk_node_num, m->node_size, m->blk_size/1048576.0);
   printf ("mem_to_max:\thtabs[%.2f]MB, nodes[%.2f]MB, total[%.2f]MB\n",
 	  t->mem_htabs / d, t->mem_nodes / d, (t->mem_htabs + t->mem_nodes) / d);
   printf ("mem_in_use:\thtabs[%.2f]MB, nodes[%.2f]MB, total[%.2f]MB\n",
 	  t->mem_htabs / d, mem / d, (t->mem_htabs + mem) / d);
+  printf ("mem_alloc:\t%.2fMB from the %s allocator\n", h->mem.bytes / 1048576.0, h->mem.user ? "caller's" : "default");
   printf ("n1[%ld]/n2[%ld]=[%.3f],  nb1[%ld]/nb2[%ld]=[%.2f]\n",
 	  ht1->n, ht2->n, ht1->n * 1.0 / ht2->n, ht1->nb, ht2->nb,
 	  ht1->nb * 1.0 / ht2->nb);
-  printf ("r1[%f]/r2[%f],  performance_wall[%.1f%%]\n",
+  printf ("r1[%f]/r2[%f],  performance_wall[%.1f%%],  seat_match[%s],  pos[%s]\n",
 	  ht1->nb * 1.0 / ht1->n, ht2->nb * 1.0 / ht2->n,
-	  ht1->n * 100.0 / (ht1->nb + ht2->nb));
+	  ht1->n * 100.0 / (ht1->nb + ht2->nb),
+	  (h->flags & HASH_INLINE) ? "inline" : seat_match_name,
+	  (h->flags & HASH_FASTRANGE) ? "fastrange" : "modulo");
   nop = ncur = nadd = ndup = nget = ndel = 0;
   printf ("---------------------------------------------------------------------------\n");
   printf ("tab n_cur %s%sn_add %s%sn_dup %s%sn_get %s%sn_del\n", b, b, b, b, b, b, b, b);
-  for (j = 0; j <= NMHT && (p = &h->ht[j]); j++)
+  for (j = 0; j <= NMHT; j++)
     {
-      ncur += p->ncur;
-      nadd += p->nadd;
-      ndup += p->ndup;
-      nget += p->nget;
-      ndel += p->ndel;
-      printf ("%-4ld%-14ld%-14ld%-14ld%-14ld%-14ld\n", j, p->ncur, p->nadd, p->ndup, p->nget, p->ndel);
+      ncur += c->ncur[j];
+      nadd += c->nadd[j];
+      ndup += c->ndup[j];
+      nget += c->nget[j];
+      ndel += c->ndel[j];
+      printf ("%-4ld%-14ld%-14ld%-14ld%-14ld%-14ld\n", j, c->ncur[j], c->nadd[j], c->ndup[j], c->nget[j], c->ndel[j]);
     }
-  op = ncur + nadd + ndup + nget + ndel + t->get_nohit + t->del_nohit + t->add_nosit + t->add_nomem + t->escapes;
+  op = ncur + nadd + ndup + nget + ndel + c->get_nohit + c->del_nohit + t->add_nosit + t->add_nomem + t->escapes;
   printf ("sum %-14ld%-14ld%-14ld%-14ld%-14ld\n", ncur, nadd, ndup, nget, ndel);
   printf ("---------------------------------------------------------------------------\n");
   printf ("del_nohit %sget_nohit %sadd_nosit %sadd_nomem %sexpires %sescapes\n", b, b, b, b, b);
-  printf ("%-14ld%-14ld%-14ld%-14ld%-12ld%-12ld\n", t->del_nohit,
-	  t->get_nohit, t->add_nosit, t->add_nomem, t->expires, t->escapes);
+  printf ("%-14ld%-14ld%-14ld%-14ld%-12ld%-12ld\n", c->del_nohit,
+	  c->get_nohit, t->add_nosit, t->add_nomem, c->expires, t->escapes);
   printf ("---------------------------------------------------------------------------\n");
+  if (h->bf)
+    printf ("bloom[%.2f]MB:\tneg[%ld], fp[%ld], fp_rate[%.3f%%]\n", t->mem_bloom / d,
+            c->bloom_neg, c->bloom_fp,
+            c->bloom_fp * 100.0 / (c->bloom_fp + c->bloom_neg ? c->bloom_fp + c->bloom_neg : 1));
+  for (j = 0; j < NSTASH && ld (h->stash[j]); j++);
+  printf ("stash:\t\tlevels[%ld/%d], seats[%ld], keys[%ld]\n", j, NSTASH, ld (h->ht[NMHT].nb), ld (h->ht[NMHT].ncur));
+  if ((f = fopen ("/proc/self/statm", "r")))
+    {
+      if (fscanf (f, "%*u %lu", &rss) != 1)
+        rss = 0;
+      fclose (f);
+    }
+  printf ("pool:\t\tblocks[%u], released[%u], trimmed[%ld], reserve[%ld], blocks_by_add[%ld], process rss[%.2f]MB\n",
+          ld (m->curr_blocks) - ld (m->rel_blocks), ld (m->rel_blocks), t->blk_released, ld (h->reserve), t->blk_by_add,
+          rss * sysconf (_SC_PAGESIZE) / 1048576.0);
+  if (h->flags & HASH_EPOCH)
+    printf ("epoch:\t\tepoch[%lu], nodes retired[%ld], reclaimed[%ld], in limbo[%ld]\n",
+            ld (h->gepoch), t->retired, t->reclaimed, t->retired - t->reclaimed);
+  if (h->flags & HASH_COMPACT)
+    printf ("compact:\tmoved[%ld], blocks drained[%ld/%ld], draining[%u]\n",
+            t->compacted, t->blk_drained, t->blk_drains, ld (m->drain_blocks));
+  if (h->flags & HASH_HUGEPAGE)
+    {
+      if ((f = fopen ("/proc/self/smaps_rollup", "r")))
+        {
+          while (fgets (line, sizeof (line), f) && sscanf (line, "AnonHugePages: %lu", &ahp) != 1);
+          fclose (f);
+        }
+      printf ("hugepage:\thtabs hugetlb[%.2f]MB, thp advised[%.2f]MB, blocks on hugetlb[%u/%u], "
+              "process AnonHugePages[%.2f]MB\n", t->mem_hugetlb / d, t->mem_thp / d,
+              ld (m->hugetlb_blocks), ld (m->curr_blocks), ahp / d);
+    }
+  if (h->flags & HASH_NUMA)
+    {
+      printf ("numa:\t\tnodes[%lu], blocks per node[", h->nnuma);
+      for (k = 0; k < h->nnuma; k++)
+        {
+          for (j = nblk = 0; j < ld (m->curr_blocks); j++)
+            nblk += (mem_block (m, j) && ld (ld_acq (m->dir[j >> PW2_DIR_LEAF])->node[j & DIR_MASK]) == k);
+          printf (k ? " %lu" : "%lu", nblk);
+        }
+      printf ("]\n");
+    }
+  for (j = 0, g = ld_acq (h->mags); g; g = g->next)
+    j += (ld (g->h) != NULL);
+  printf ("contention:\theld nodes waited by parking[%ld], given up[%ld], spin[%lu] pauses, park up to [%lu]ms\n",
+          t->parks, t->escapes, h->spin, h->park_ms);
+  printf ("freelist:\tcas_retries[%ld], mag_refills[%ld], mag_spills[%ld], threads[%ld]\n",
+          t->fl_retry, t->mag_refill, t->mag_spill, j);
+  printf ("buckets:\t%.2f bytes per max key, %.2f per key in use, displaces[%ld]\n",
+          t->mem_htabs * d / ht1->n, ncur ? t->mem_htabs * d / ncur : 0.0, t->displaces);
   if (escaped_milliseconds > 0)
-    printf ("escaped_time=%.3fs, op=%ld, ops=%.2fM/s\n", escaped_milliseconds * 1.0 / 1000, op,
-	    (double) op / 1000.0 / escaped_milliseconds);
+    printf ("escaped_time=%.3fs, op=%ld, ops=%.2fM/s, prefetch[%s]\n", escaped_milliseconds * 1.0 / 1000, op,
+	    (double) op / 1000.0 / escaped_milliseconds, h->prefetch ? "on" : "off");
   printf ("\n");
   fflush (stdout);
   return 0;
@@ -385,375 +1165,1694 @@ int
 atomic_hash_destroy (hash_t * h)
 {
   unsigned int j;
+  mag_t *g;
   if (!h)
     return -1;
-  for (j = 0; j < h->nmht; j++)
-    free (h->ht[j].b);
+  if (h->flags & HASH_PREALLOC)
+    {
+      st (h->prealloc_stop, 1);
+      pthread_join (h->prealloc_tid, NULL);
+    }
+  for (j = 0; j <= h->nmht; j++)
+    free_htab (&h->ht[j], &h->mem);
+  for (j = 1; j < NSTASH; j++)
+    mem_free (&h->mem, h->stash[j], (MINTAB << j) * sizeof (seat_t));
+  while ((g = h->mags))
+    {
+      h->mags = g->next;
+      mem_free (&h->mem, g, sizeof (*g));
+    }
   destroy_mem_pool (h->mp);
-  free (h);
+  free_hash (h);
   return 0;
 }
 
-inline nid
-new_node (hash_t * h)
+static __thread mag_t *thread_mags; /* magazines of the calling thread, one per hash */
+
+static inline void
+node_clear (hash_t *h, node_t *p)
 {
-  memword cas_t n, m;
-  while (h->freelist.mi != NNULL || new_mem_block (h->mp, &h->freelist))
+  if (small (h))
     {
-      n.all = h->freelist.all;
-      if (n.mi == NNULL)
-	    continue;
-      m.mi = ((cas_t *) (i2p (h->mp, node_t, n.mi)))->mi;
-      m.rfn = n.rfn + 1;
-      if (cas (&h->freelist.all, n.all, m.all))
-        return n.mi;
+      st (sn (p)->x, 0);
+      st (sn (p)->y, 0);
+      st (sn (p)->expire, 0);
+      st (sn (p)->data, 0);
+      return;
     }
-  add1 (h->stats.add_nomem);
-  return NNULL;
+  st (p->expire, ver_released (ld (p->expire)));
+  wfence (); /* odd before the node changes */
+  st (p->v.x, 0);
+  st (p->v.y, 0);
+  st (p->data, NULL);
 }
 
-inline void
-free_node (hash_t * h, nid mi)
+static inline mag_t *
+thread_mag (hash_t *h)
+{
+  mag_t *g;
+  for (g = thread_mags; g && g->h != h; g = g->tnext);
+  return g;
+}
+
+/* HASH_NUMA: numa node of the calling thread, 0 if one node */
+static inline unsigned int
+thread_node (hash_t *h)
+{
+  unsigned int cpu, k;
+  if (h->nnuma > 1 && getcpu (&cpu, &k) == 0 && k < h->nnuma)
+    return k;
+  return 0;
+}
+
+/* HASH_NUMA: numa node of the block of mi, 0 if one node */
+static inline unsigned int
+block_node (hash_t *h, nid mi)
+{
+  mem_pool_t *mp = h->mp;
+  return h->nnuma > 1 ? ld (ld_acq (mp->dir[mi >> mp->dshift])->node[(mi >> mp->shift) & DIR_MASK]) : 0;
+}
+
+/* a block allocated by an add that found no free node, HASH_PREALLOC avoids it */
+static inline nid *
+grow_on_add (hash_t *h, unsigned int k)
 {
+  nid *r = new_mem_block (h->mp, node_list (h, k), k);
+  if (r)
+    add1 (h->stats.blk_by_add);
+  return r;
+}
+
+/* HASH_COMPACT, HASH_ELASTIC: retire mi instead of freeing or using it if
+ * its block is draining or trimmed */
+static inline int
+free_retired (hash_t *h, nid mi)
+{
+  int r = retire_node (h->mp, mi);
+  if (r == 2)
+    add1 (h->stats.blk_drained);
+  else if (r == 3)
+    add1 (h->stats.blk_released);
+  return r;
+}
+
+/* pop up to num nodes of fl with one CAS. Links are read from nodes that
+ * other threads may pop and reuse meanwhile; such a link is checked against
+ * the pool blocks before it is followed, and the CAS then fails on rfn */
+static unsigned int
+list_pop (hash_t *h, volatile cas_t *fl, nid *mi, unsigned int num)
+{
+  mem_pool_t *mp = h->mp;
   memword cas_t n, m;
-  cas_t *p = (cas_t *) (i2p (h->mp, node_t, mi));
-  p->rfn = 0;
-  m.mi = mi;
-  do
+  unsigned int i;
+  while (ld (fl->mi) != NNULL)
     {
-      n.all = h->freelist.all;
+      n.all = ld_acq (fl->all); /* links pushed before n are read */
+      for (m.mi = n.mi, i = 0; i < num && m.mi != NNULL; i++)
+        {
+          if (!mem_block (mp, m.mi >> mp->shift))
+            break; /* stale link */
+          mi[i] = m.mi;
+          m.mi = ld (((cas_t *) (i2p (mp, node_t, m.mi)))->mi);
+        }
+      if (i == 0)
+        continue;
       m.rfn = n.rfn + 1;
-      p->mi = n.mi;
+      if (cas_mo (&fl->all, n.all, m.all, memory_order_relaxed)) /* n unchanged: nothing more to acquire */
+        return i;
+      add1 (h->stats.fl_retry);
+    }
+  return 0;
+}
+
+/* HASH_ELASTIC, HASH_COMPACT: add d to the free counts of the blocks of num nodes, once
+ * per run of nodes of one block. Nodes are counted before they are pushed
+ * and uncounted after they are popped, so a count is never short of the
+ * nodes in the lists and a block is full only if no node of it is in use */
+static void
+count_free (hash_t *h, nid *mi, unsigned int num, int d)
+{
+  mem_pool_t *mp = h->mp;
+  unsigned int i, j;
+  if (!(h->flags & (HASH_ELASTIC | HASH_COMPACT)))
+    return;
+  for (i = 0; i < num; i = j)
+    {
+      for (j = i + 1; j < num && mi[j] >> mp->shift == mi[i] >> mp->shift; j++);
+      addn (ld_acq (mp->dir[mi[i] >> mp->dshift])->nfree[(mi[i] >> mp->shift) & DIR_MASK], (nid) (d * (int) (j - i)));
     }
-  while (!cas (&h->freelist.all, n.all, m.all));
 }
 
-inline void
-set_hash_node (node_t * p, hv v, void *data, unsigned long expire)
+/* pop up to num nodes of numa node k, from the list it frees to, then from
+ * the one being swept, else grow the pool. Nodes of draining or trimmed
+ * blocks are retired instead of returned */
+static unsigned int
+freelist_pop (hash_t *h, unsigned int k, nid *mi, unsigned int num)
 {
-  p->v = v;
-  p->expire = expire;
-  p->data = data;
+  unsigned long s;
+  unsigned int i, j, n;
+  while (1)
+    {
+      s = ld (h->fside);
+      if (!(n = list_pop (h, free_list (h, k, s), mi, num)) && !(n = list_pop (h, free_list (h, k, !s), mi, num)))
+        {
+          if (!grow_on_add (h, k))
+            return 0;
+          continue;
+        }
+      count_free (h, mi, n, -1);
+      if (ld (h->mp->drain_blocks) == 0)
+        return n;
+      for (i = j = 0; j < n; j++)
+        if (!free_retired (h, mi[j]))
+          mi[i++] = mi[j];
+      if (i > 0)
+        return i;
+    }
 }
 
-inline int
-likely_equal (hv w, hv v)
+/* nodes of the caller's numa node, or of the others if it can not grow */
+static unsigned int
+local_pop (hash_t *h, nid *mi, unsigned int num)
 {
-  return w.y == v.y;
+  unsigned int k = thread_node (h), i, r = freelist_pop (h, k, mi, num);
+  for (i = 1; r == 0 && i < h->nnuma; i++)
+    r = freelist_pop (h, (k + i) % h->nnuma, mi, num);
+  return r;
 }
 
-/* only called in atomic_hash_get */
-inline int
-try_get (hash_t *h, hv v, node_t *p, nid *seat, nid mi, int idx,  hook cbf, void *rtn)
+/* chain num > 0 nodes and push them to fl with one CAS */
+static void
+list_push (hash_t *h, volatile cas_t *fl, nid *mi, unsigned int num)
 {
-  hold_bucket_otherwise_return_0 (p->v, v);
-  if (*seat != mi)
+  memword cas_t n, m;
+  cas_t *p, *q;
+  unsigned int i;
+  p = &ip (h->mp, cas_t, mi[0]);
+  st (p->rfn, 0);
+  for (i = 1; i < num; i++)
     {
-      unhold_bucket (p->v, v);
-      return 0;
+      q = p;
+      p = &ip (h->mp, cas_t, mi[i]);
+      st (p->rfn, 0);
+      st (q->mi, mi[i]);
     }
-  int result = cbf ? cbf (p->data, rtn) : h->on_get (p->data, rtn);
-  if (result == PLEASE_REMOVE_HASH_NODE)
+  m.mi = mi[0];
+  while (1)
     {
-      if (cas (seat, mi, NNULL))
-        atomic_sub1 (h->ht[idx].ncur);
-      memset (p, 0, sizeof (*p));
-      add1 (h->ht[idx].nget);
-      free_node (h, mi);
-      return 1;
+      n.all = ld (fl->all);
+      m.rfn = n.rfn + 1;
+      st (p->mi, n.mi);
+      if (cas_rel (&fl->all, n.all, m.all))
+        return;
+      add1 (h->stats.fl_retry);
     }
-  if (result == PLEASE_SET_TTL_TO_DEFAULT)
-    result = h->reset_expire;
-  if (p->expire > 0 && result > 0)
-    p->expire = result + nowms ();  
-  unhold_bucket (p->v, v);
-  add1 (h->ht[idx].nget);
-  return 1;
 }
 
-/* only called in atomic_hash_add */
-inline int
-try_dup (hash_t *h, hv v, node_t *p, nid *seat, nid mi, int idx,  hook cbf, void *rtn)
+/* free num nodes, each to the list of its block's numa node */
+static void
+freelist_push (hash_t *h, nid *mi, unsigned int num)
 {
-  hold_bucket_otherwise_return_0 (p->v, v);
-  if (*seat != mi)
+  unsigned int i, j, l, k;
+  nid t;
+  if (ld (h->mp->drain_blocks) > 0) /* nodes of draining blocks stay out */
     {
-      unhold_bucket (p->v, v);
-      return 0;
+      for (i = j = 0; i < num; i++)
+        if (!free_retired (h, mi[i]))
+          mi[j++] = mi[i];
+      num = j;
     }
-  int result = cbf ? cbf (p->data, rtn) : h->on_dup (p->data, rtn);
-  if (result == PLEASE_REMOVE_HASH_NODE)
+  if (num == 0)
+    return;
+  count_free (h, mi, num, 1);
+  if (h->nnuma == 1)
     {
-      if (cas (seat, mi, NNULL))
-        atomic_sub1 (h->ht[idx].ncur);
-      memset (p, 0, sizeof (*p));
-      add1 (h->ht[idx].ndup);
-      free_node (h, mi);
-      return 1;
+      list_push (h, node_list (h, 0), mi, num);
+      return;
+    }
+  for (i = 0; i < num; i = j) /* gather the nodes of mi[i]'s numa node after it */
+    {
+      k = block_node (h, mi[i]);
+      for (j = l = i + 1; l < num; l++)
+        if (block_node (h, mi[l]) == k)
+          {
+            t = mi[j];
+            mi[j++] = mi[l];
+            mi[l] = t;
+          }
+      list_push (h, node_list (h, k), &mi[i], j - i);
     }
-  if (result == PLEASE_SET_TTL_TO_DEFAULT)
-    result = h->reset_expire;
-  if (p->expire > 0 && result > 0)
-    p->expire = result + nowms ();  
-  unhold_bucket (p->v, v);
-  add1 (h->ht[idx].ndup);
-  return 1;
 }
 
-/* only called in atomic_hash_add */
-inline int
-try_add (hash_t *h, node_t *p, nid *seat, nid mi, int idx, void *rtn)
+static inline void
+free_node (hash_t * h, nid mi)
 {
-  hvu x = p->v.x;
-  p->v.x = 0;
-  if (!cas (seat, NNULL, mi))
+  mag_t *g = thread_mag (h);
+  if (ld (h->mp->drain_blocks) > 0 && free_retired (h, mi))
+    return;
+  if (!g)
     {
-      p->v.x = x;
-      return 0; /* other thread wins, caller to retry other seats */
+      count_free (h, &mi, 1, 1);
+      list_push (h, node_list (h, block_node (h, mi)), &mi, 1);
+      return;
     }
-  atomic_add1 (h->ht[idx].ncur);
-  int result = h->on_add (p->data, rtn);
-  if (result == PLEASE_REMOVE_HASH_NODE)
+  if (g->n == NMAG)
     {
-      if (cas (seat, mi, NNULL))
-        atomic_sub1 (h->ht[idx].ncur);
-      memset (p, 0, sizeof (*p));
-      free_node (h, mi);
-      return 1;	/* abort adding this node */
+      g->n -= NMAG / 2;
+      freelist_push (h, &g->mi[g->n], NMAG / 2);
+      add1 (h->stats.mag_spill);
     }
-  if (result == PLEASE_SET_TTL_TO_DEFAULT)
-    result = h->reset_expire;
-  if (p->expire > 0 && result > 0)
-    p->expire = result + nowms ();  
-  p->v.x = x;
-  add1 (h->ht[idx].nadd);
-  return 1;
+  g->mi[g->n++] = mi;
 }
 
-/* only called in atomic_hash_del */
-inline int
-try_del (hash_t *h, hv v, node_t *p, nid *seat, nid mi, int idx,  hook cbf, void *rtn)
+/* HASH_EPOCH: the epoch can advance from e once every registered thread in
+ * a get has seen e; then no get can reach the nodes retired in e - 1, kept
+ * in limbo[(e + 2) % 3], and they are freed. One thread advances at a time */
+static void
+epoch_advance (hash_t *h)
 {
-  hold_bucket_otherwise_return_0 (p->v, v);
-  if (*seat != mi || !cas (seat, mi, NNULL))
+  memword cas_t n, m;
+  volatile cas_t *l;
+  unsigned long e;
+  cas_t *p;
+  mag_t *g;
+  nid mi, next;
+  if (ld (h->epoch_busy) || !cas_acq (&h->epoch_busy, 0, 1))
+    return;
+  e = ld (h->gepoch);
+  fence (); /* gets read after e */
+  for (g = ld_acq (h->mags); g && (!ld (g->epoch) || ld (g->epoch) == e); g = g->next);
+  if (g)
     {
-      unhold_bucket (p->v, v);
-      return 0;
+      st_rel (h->epoch_busy, 0);
+      return;
     }
-  atomic_sub1 (h->ht[idx].ncur);
-  void *user_data = p->data;
-  memset (p, 0, sizeof (*p));
-  add1 (h->ht[idx].ndel);
-  free_node (h, mi);
-  if (cbf)
-    cbf (user_data, rtn);
-  else
-    h->on_del (user_data, rtn);
-  return 1;
-}
+  /* seq_cst: a retirer that fenced after unseating its node then reads e + 1
+   * or puts the node in limbo[e % 3], not in the one taken below */
+  __atomic_store_n (&h->gepoch, e + 1, memory_order_seq_cst);
+  l = &h->limbo[(e + 2) % 3];
+  m.mi = NNULL;
+  do
+    {
+      n.all = ld (l->all);
+      m.rfn = n.rfn + 1;
+    }
+  while (!cas_acq (&l->all, n.all, m.all));
+  st_rel (h->epoch_busy, 0);
+  for (mi = n.mi; mi != NNULL; mi = next)
+    {
+      p = (cas_t *) i2p (h->mp, node_t, mi);
+      next = ld (p->mi);
+      node_clear (h, (node_t *) p);
+      free_node (h, mi);
+      add1 (h->stats.reclaimed);
+    }
+}
+
+/* HASH_EPOCH: a get of a registered thread shows the epoch before it reads
+ * any seat. return its magazine, or NULL for a get to hold nodes (as in a
+ * hook of a get in its epoch) */
+static inline mag_t *
+epoch_enter (hash_t *h)
+{
+  mag_t *g;
+  if (!(h->flags & HASH_EPOCH) || !(g = thread_mag (h)) || g->epoch)
+    return NULL;
+  st (g->epoch, ld (h->gepoch));
+  fence (); /* seen before any seat is read */
+  return g;
+}
+#define epoch_exit(g) do { if (g) st_rel ((g)->epoch, 0); } while (0)
+
+static inline nid
+new_node (hash_t * h)
+{
+  nid mi;
+  unsigned int k;
+  mag_t *g = thread_mag (h);
+  for (k = 0; k < 3; k++)
+    {
+      if (g)
+        {
+          if (g->n == 0 && (g->n = local_pop (h, g->mi, NMAG / 2)) > 0)
+            add1 (h->stats.mag_refill);
+          if (g->n > 0)
+            return g->mi[--g->n];
+        }
+      else if (local_pop (h, &mi, 1))
+        return mi;
+      if (!(h->flags & HASH_EPOCH) || ld (h->stats.retired) == ld (h->stats.reclaimed))
+        break;
+      epoch_advance (h); /* frees the oldest limbo list, if no get holds it back */
+    }
+  add1 (h->stats.add_nomem);
+  return NNULL;
+}
+
+int
+atomic_hash_register (hash_t *h)
+{
+  mag_t *g;
+  if (!h)
+    return -1;
+  if (thread_mag (h))
+    return 0;
+  for (g = ld_acq (h->mags); g; g = g->next)
+    if (!ld (g->h) && cas_acq (&g->h, NULL, h))
+      break; /* reuse one left by a gone thread */
+  if (!g)
+    {
+      if (!(g = mem_alloc (&h->mem, sizeof (*g), 64, HASH_NODE_ANY, 1)))
+        return -1;
+      g->h = h;
+      do
+        g->next = ld (h->mags);
+      while (!cas_rel (&h->mags, g->next, g));
+    }
+  g->n = 0;
+  g->tnext = thread_mags;
+  thread_mags = g;
+  return 0;
+}
+
+int
+atomic_hash_unregister (hash_t *h)
+{
+  mag_t *g, **pg;
+  for (pg = &thread_mags; (g = *pg) && g->h != h; pg = &g->tnext);
+  if (!g)
+    return -1;
+  *pg = g->tnext;
+  freelist_push (h, g->mi, g->n);
+  g->n = 0;
+  g->tnext = NULL;
+  st_rel (g->h, NULL); /* emptied before another thread takes it */
+  return 0;
+}
+
+static inline unsigned long
+node_expire (hash_t *h, node_t *p)
+{
+  unsigned long t;
+  if (!small (h))
+    return EXPIRE_MS (ld (p->expire));
+  return (t = ld (sn (p)->expire)) ? h->epoch + (t << SMALL_TICK_SHIFT) : 0;
+}
+
+/* HASH_SMALL: rounded up to the next tick, so a node never expires early */
+static inline void
+set_node_expire (hash_t *h, node_t *p, unsigned long expire)
+{
+  unsigned long t;
+  if (!small (h))
+    st (p->expire, (ld (p->expire) & ~EXPIRE_MS (~0UL)) | expire);
+  else if (expire == 0)
+    st (sn (p)->expire, 0);
+  else
+    {
+      t = expire > h->epoch ? ((expire - h->epoch) >> SMALL_TICK_SHIFT) + 1 : 1;
+      st (sn (p)->expire, t > UINT32_MAX ? UINT32_MAX : t);
+    }
+}
+
+static inline void
+set_hash_node (hash_t *h, node_t * p, hv v, void *data, unsigned long expire)
+{
+  if (small (h))
+    {
+      st (sn (p)->x, (nid) v.x);
+      st (sn (p)->y, (nid) v.y);
+      st (sn (p)->data, (uintptr_t) data);
+    }
+  else
+    {
+      st (p->v.x, v.x);
+      st (p->v.y, v.y);
+      st (p->data, data);
+      st_rel (p->expire, ver_filled (ld (p->expire)) | expire); /* filled before the version turns even */
+      return;
+    }
+  set_node_expire (h, p, expire);
+}
+
+static inline int
+likely_equal (hv w, hv v)
+{
+  return w.y == v.y;
+}
+#define node_equal(h, p, w) (small (h) ? ld (sn (p)->y) == (nid) (w).y : likely_equal (node_hv (h, p), w))
 
-inline int
-valid_ttl (hash_t *h, unsigned long now, node_t *p, nid *seat, nid mi,
+/* a key owns 2 distinct groups in each bucket array, all in g[NGRP] */
+#define group_of(pt, n) ((seat_t *) ((char *) (pt)->b + ((unsigned long) (n) << (pt)->gshift)))
+#define next_group(pt, g0, g1) ((g1) != (g0) ? (g1) : ((g0) + 1 == (pt)->ng ? 0 : (g0) + 1))
+/* HASH_FASTRANGE: (d * ng) >> 32 spreads d over [0, ng) like d % ng, no division */
+#define reduce(pt, d) ((h->flags & HASH_FASTRANGE) ? (nid) (((uint64_t) (nid) (d) * (pt)->ng) >> 32) \
+                        : (nid) (d) % (pt)->ng)
+
+/* g[0], the ht[0] group picked by d[0] (low bits of hv.x), is the home group
+ * of a key. h->ovf[home] counts keys of that home seated in other groups or
+ * in the collision array, so lookups stop after home while it is 0.
+ * return the counter to update if seat is away from home, else NULL */
+static inline unsigned int *
+away_counter (hash_t *h, void *seat, hvu x)
+{
+  nid home = reduce (&h->ht[0], x);
+  char *g = (char *) group_of (&h->ht[0], home);
+  return ((char *) seat >= g && (char *) seat < g + (1UL << h->ht[0].gshift)) ? NULL : &h->ovf[home];
+}
+
+/* counting bloom filter: high 32 bits of bh pick the block, BF_K x 7 low
+ * bits pick 4-bit counters in it. A counter stuck at 15 is never decreased,
+ * so a key still seated always tests positive */
+#define bloom_hash(v) ((((uint64_t) (nid) (v).x << 32) | (nid) (v).y) * 11400714819323198485UL) /* low halves, kept by HASH_SMALL */
+#define bloom_block(h, bh) (&(h)->bf[(((bh) >> 32) * (h)->nbf >> 32) * 8])
+
+static inline void
+bloom_add (hash_t *h, hv v)
+{
+  uint64_t bh = bloom_hash (v), *b = bloom_block (h, bh), o, c;
+  unsigned int i, k, sft;
+  for (i = 0; i < BF_K; i++)
+    {
+      k = (bh >> (7 * i)) & 127;
+      sft = (k & 15) * 4;
+      do
+        {
+          o = ld (b[k >> 4]);
+          if ((c = (o >> sft) & 15) == 15)
+            break;
+        }
+      while (!cas_mo (&b[k >> 4], o, o + (1UL << sft), memory_order_relaxed)); /* the seat orders it */
+    }
+}
+
+static inline void
+bloom_del (hash_t *h, hv v)
+{
+  uint64_t bh = bloom_hash (v), *b = bloom_block (h, bh), o, c;
+  unsigned int i, k, sft;
+  for (i = 0; i < BF_K; i++)
+    {
+      k = (bh >> (7 * i)) & 127;
+      sft = (k & 15) * 4;
+      do
+        {
+          o = ld (b[k >> 4]);
+          if ((c = (o >> sft) & 15) == 15 || c == 0)
+            break;
+        }
+      while (!cas_mo (&b[k >> 4], o, o - (1UL << sft), memory_order_relaxed));
+    }
+}
+
+static inline int
+bloom_test (hash_t *h, hv v)
+{
+  uint64_t bh = bloom_hash (v), *b = bloom_block (h, bh);
+  unsigned int i, k;
+  for (i = 0; i < BF_K; i++)
+    {
+      k = (bh >> (7 * i)) & 127;
+      if (((ld (b[k >> 4]) >> ((k & 15) * 4)) & 15) == 0)
+        return 0;
+    }
+  return 1;
+}
+
+/* array 3, the stash for keys whose 4 groups are full: level l has MINTAB << l
+ * seats and is added on demand, up to NSTASH levels. A key owns one group per
+ * level, picked by the top bits of stash_hash, a slice of hv not used by the
+ * groups of array 1 and 2. Keys go to the lowest level with a free seat in
+ * their group, lookups match one group per level */
+#define stash_hash(v) (((v).x - (v).y) * 11400714819323198485UL)
+#define stash_group(h, l, sh) (ld_acq ((h)->stash[l]) + ((sh) >> (64 - STASH_BITS - (l))) * NGSEAT)
+
+static seat_t *
+stash_grow (hash_t *h, unsigned int l)
+{
+  unsigned long nb = (unsigned long) MINTAB << l;
+  seat_t *b;
+  if (!(b = mem_alloc (&h->mem, nb * sizeof (*b), 64, HASH_NODE_ANY, 1)))
+    return NULL;
+  if (!cas_rel (&h->stash[l], NULL, b))
+    {
+      mem_free (&h->mem, b, nb * sizeof (*b)); /* other thread wins */
+      return ld_acq (h->stash[l]);
+    }
+  addn (h->ht[NMHT].nb, nb);
+  addn (h->stats.mem_htabs, (nb * sizeof (*b)) >> 10);
+  return b;
+}
+
+/* book-keeping for a key that just lost its seat */
+#define seat_released(h, idx, v, seat) do { unsigned int *__o; \
+  count_cur (h, idx, -1); \
+  if ((h)->bf) bloom_del (h, v); \
+  if ((__o = away_counter (h, seat, (v).x))) atomic_sub1 (*__o); \
+  } while (0)
+
+/* HASH_INLINE nodes of array 1 and 2 are their own seats, passed as
+ * seat == NULL: v.y != 0 holds the place, v.y == 0 frees it */
+#define seat_moved(seat, s) ((seat) && ld ((seat)->all) != (s).all)
+#define clear_seat(seat, s) (!(seat) || cas (&(seat)->all, (s).all, SEAT_EMPTY))
+#define seat_of(seat, p) ((seat) ? (void *) (seat) : (void *) (p))
+
+/* HASH_EPOCH: p is held and out of its seat. v.y = 0 turns holders away,
+ * its data stays for gets still reading it until the epoch frees it */
+static inline void
+epoch_retire (hash_t *h, node_t *p, nid mi)
+{
+  if (small (h))
+    st (sn (p)->y, 0);
+  else
+    st (p->v.y, 0);
+  fence (); /* out of its seat before the epoch is read */
+  list_push (h, &h->limbo[ld (h->gepoch) % 3], &mi, 1);
+  if (((add1 (h->stats.retired) + 1) & (EPOCH_EVERY - 1)) == 0)
+    epoch_advance (h);
+}
+
+/* called with p held (v.x == 0) and already out of its seat */
+static inline void
+release_node (hash_t *h, node_t *p, seat_t *seat, nid mi)
+{
+  if (seat && (h->flags & HASH_EPOCH))
+    {
+      epoch_retire (h, p, mi);
+      unpark (h, p);
+      return;
+    }
+  if (seat)
+    {
+      node_clear (h, p);
+      fence (); /* released before parked threads are looked up */
+      unpark (h, p);
+      free_node (h, mi);
+      return;
+    }
+  st (p->expire, ver_released (ld (p->expire)));
+  wfence (); /* odd before the node changes */
+  st (p->data, NULL);
+  st_rel (p->v.y, 0); /* cleared before it can be claimed again */
+  fence ();
+  unpark (h, p);
+}
+
+/* only called in atomic_hash_get */
+static inline int
+try_get (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx,  hook cbf, void *rtn)
+{
+  hold_node_otherwise_return_0 (h, p, v);
+  if (seat_moved (seat, s))
+    {
+      unhold_node (h, p, v);
+      return 0;
+    }
+  int result = cbf ? cbf (node_data (h, p), rtn) : h->on_get (node_data (h, p), rtn);
+  if (result == PLEASE_REMOVE_HASH_NODE)
+    {
+      if (clear_seat (seat, s))
+        seat_released (h, idx, v, seat_of (seat, p));
+      release_node (h, p, seat, s.mi);
+      count (h, nget[idx]);
+      return 1;
+    }
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  if (node_expire (h, p) > 0 && result > 0)
+    set_node_expire (h, p, result + nowms ());
+  unhold_node (h, p, v);
+  count (h, nget[idx]);
+  return 1;
+}
+
+/* HASH_OPTREAD: the writes a get may still need, under the hold as in
+ * try_get, if p is still the node read at version e */
+static int
+opt_write (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx, unsigned long e, int result, unsigned long now)
+{
+  hold_node_otherwise_return_0 (h, p, v);
+  if (seat_moved (seat, s) || (!small (h) && (ld (p->expire) ^ e) >> VER_SHIFT))
+    {
+      unhold_node (h, p, v);
+      return 0;
+    }
+  if (result == PLEASE_REMOVE_HASH_NODE)
+    {
+      if (clear_seat (seat, s))
+        seat_released (h, idx, v, seat_of (seat, p));
+      release_node (h, p, seat, s.mi);
+      return 1;
+    }
+  set_node_expire (h, p, result + now);
+  unhold_node (h, p, v);
+  return 1;
+}
+
+/* HASH_OPTREAD version of try_get, for node_t: no hold, the version (even and
+ * unchanged), hv and seat read again after the data prove the read. return 0
+ * for try_get to take the hold, on a held node or a failed check, also when
+ * the hook asked for a write that opt_write could not make: the hook runs
+ * again there */
+static inline int
+try_get_opt (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx, hook cbf, void *rtn, unsigned long now)
+{
+  unsigned long e = ld_acq (p->expire), t;
+  void *data;
+  if (ver_odd (e) || ld (p->v.x) != v.x)
+    return 0;
+  data = ld (p->data);
+  rfence ();
+  if (ld (p->expire) != e || ld (p->v.y) != v.y || seat_moved (seat, s))
+    return 0;
+  int result = cbf ? cbf (data, rtn) : h->on_get (data, rtn);
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  /* refresh a ttl only once it has lost a quarter */
+  if (result == PLEASE_REMOVE_HASH_NODE
+      || ((t = EXPIRE_MS (e)) > 0 && result > 0 && t < now + result - result / TTL_SLACK))
+    if (!opt_write (h, v, p, seat, s, idx, e, result, now))
+      return 0;
+  count (h, nget[idx]);
+  return 1;
+}
+
+/* HASH_EPOCH version of try_get, for a registered thread in its epoch: p
+ * is not reused before the get returns and keeps its data when released,
+ * so a node still of the key is read as is, held or not. A write the hook
+ * asked for that opt_write could not make falls back to try_get as above */
+static inline int
+try_get_epoch (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx, hook cbf, void *rtn, unsigned long now)
+{
+  unsigned long e = small (h) ? 0 : ld (p->expire), t;
+  void *data;
+  if (!node_equal (h, p, v))
+    return 0; /* released */
+  rfence ();
+  data = node_data (h, p);
+  int result = cbf ? cbf (data, rtn) : h->on_get (data, rtn);
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  if (result == PLEASE_REMOVE_HASH_NODE
+      || ((t = node_expire (h, p)) > 0 && result > 0 && t < now + result - result / TTL_SLACK))
+    if (!opt_write (h, v, p, seat, s, idx, e, result, now))
+      return try_get (h, v, p, seat, s, idx, cbf, rtn);
+  count (h, nget[idx]);
+  return 1;
+}
+
+/* only called in probe_get, ge: magazine of a get in its epoch, or NULL */
+#define get_node(h, v, p, seat, s, idx, cbf, rtn, now, ge) \
+  ((ge) && (seat) ? try_get_epoch (h, v, p, seat, s, idx, cbf, rtn, now) \
+   : ((((h)->flags & HASH_OPTREAD) && !small (h) && try_get_opt (h, v, p, seat, s, idx, cbf, rtn, now)) \
+      || try_get (h, v, p, seat, s, idx, cbf, rtn)))
+
+/* only called in atomic_hash_add */
+static inline int
+try_dup (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx,  hook cbf, void *rtn)
+{
+  hold_node_otherwise_return_0 (h, p, v);
+  if (seat_moved (seat, s))
+    {
+      unhold_node (h, p, v);
+      return 0;
+    }
+  int result = cbf ? cbf (node_data (h, p), rtn) : h->on_dup (node_data (h, p), rtn);
+  if (result == PLEASE_REMOVE_HASH_NODE)
+    {
+      if (clear_seat (seat, s))
+        seat_released (h, idx, v, seat_of (seat, p));
+      release_node (h, p, seat, s.mi);
+      count (h, ndup[idx]);
+      return 1;
+    }
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  if (node_expire (h, p) > 0 && result > 0)
+    set_node_expire (h, p, result + nowms ());
+  unhold_node (h, p, v);
+  count (h, ndup[idx]);
+  return 1;
+}
+
+/* only called in atomic_hash_add. p is not seated yet, but a thread holding
+ * it through a stale seat of its last key (same hv) releases it soon */
+static inline int
+try_add (hash_t *h, node_t *p, hv v, seat_t *seat, seat_t s, int idx, void *rtn)
+{
+  hvu x = v.x;
+  unsigned long w = 0;
+  unsigned int *o = away_counter (h, seat, x);
+  if (o)
+    atomic_add1 (*o); /* before the key can be seen away from home */
+  while (!node_hold_x (h, p, x))
+    {
+      if (w >= h->spin + h->park_ms)
+        w = h->spin; /* never given up: p is ours once the stale holder lets go */
+      hold_wait (h, p, &w); /* x is the first word of node_t and snode_t */
+    }
+  if (!cas_rel (&seat->all, SEAT_EMPTY, s.all)) /* the node filled before it is seated */
+    {
+      if (o)
+        atomic_sub1 (*o);
+      node_set_x (h, p, x);
+      fence ();
+      unpark (h, p);
+      return 0; /* other thread wins, caller to retry other seats */
+    }
+  count_cur (h, idx, 1);
+  int result = h->on_add (node_data (h, p), rtn);
+  if (result == PLEASE_REMOVE_HASH_NODE)
+    {
+      if (cas (&seat->all, s.all, SEAT_EMPTY))
+        seat_released (h, idx, v, seat);
+      release_node (h, p, seat, s.mi);
+      return 1;	/* abort adding this node */
+    }
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  if (node_expire (h, p) > 0 && result > 0)
+    set_node_expire (h, p, result + nowms ());
+  node_set_x (h, p, x);
+  fence (); /* unheld before parked threads are looked up */
+  unpark (h, p);
+  count (h, nadd[idx]);
+  return 1;
+}
+
+/* HASH_INLINE version of try_add: claim a free node in place by setting
+ * v.y, v.x stays 0 to hold it until on_add returns */
+static inline int
+try_add_inline (hash_t *h, node_t *p, hv v, void *data, unsigned long expire, int idx, void *rtn)
+{
+  unsigned int *o;
+  if (ld (p->v.y) != 0)
+    return 0;
+  if ((o = away_counter (h, p, v.x)))
+    atomic_add1 (*o); /* before the key can be seen away from home */
+  if (!cas_acq (&p->v.y, 0, v.y))
+    {
+      if (o)
+        atomic_sub1 (*o);
+      return 0; /* other thread wins, caller to retry other seats */
+    }
+  st (p->data, data);
+  st_rel (p->expire, ver_filled (ld (p->expire)) | expire); /* v.x still 0 keeps optimistic gets out */
+  count_cur (h, idx, 1);
+  int result = h->on_add (p->data, rtn);
+  if (result == PLEASE_REMOVE_HASH_NODE)
+    {
+      seat_released (h, idx, v, p);
+      release_node (h, p, NULL, NNULL);
+      return 1;	/* abort adding this node */
+    }
+  if (result == PLEASE_SET_TTL_TO_DEFAULT)
+    result = h->reset_expire;
+  if (node_expire (h, p) > 0 && result > 0)
+    set_node_expire (h, p, result + nowms ());
+  st_rel (p->v.x, v.x);
+  fence ();
+  unpark (h, p);
+  count (h, nadd[idx]);
+  return 1;
+}
+
+/* only called in atomic_hash_del */
+static inline int
+try_del (hash_t *h, hv v, node_t *p, seat_t *seat, seat_t s, int idx,  hook cbf, void *rtn)
+{
+  hold_node_otherwise_return_0 (h, p, v);
+  if (seat_moved (seat, s) || !clear_seat (seat, s))
+    {
+      unhold_node (h, p, v);
+      return 0;
+    }
+  seat_released (h, idx, v, seat_of (seat, p));
+  void *user_data = node_data (h, p);
+  release_node (h, p, seat, s.mi);
+  count (h, ndel[idx]);
+  if (cbf)
+    cbf (user_data, rtn);
+  else
+    h->on_del (user_data, rtn);
+  return 1;
+}
+
+static inline int
+valid_ttl (hash_t *h, unsigned long now, node_t *p, seat_t *seat, seat_t s,
 	   int idx, nid *node_rtn, void *data_rtn)
 {
-  unsigned long expire = p->expire;
+  unsigned long expire = node_expire (h, p);
  /* valid state, quickly skip to call try_action. */
   if (expire == 0 || expire > now)
     return 1;
-  hv v = p->v;
+  hv v = node_hv (h, p);
   /* hold on or removed by others, skip to call try_action */
   if (v.x == 0 || v.y == 0)
     return 1;
-  hold_bucket_otherwise_return_0 (p->v, v);
+  hold_node_otherwise_return_0 (h, p, v);
   /* re-enter valid state, skip to call try_action */
-  if (p->expire == 0 || p->expire > now)
+  if ((expire = node_expire (h, p)) == 0 || expire > now)
     {
-      unhold_bucket (p->v, v);
+      unhold_node (h, p, v);
       return 1;
     }
   /* expired,  now remove it */
-  if (*seat != mi || !cas (seat, mi, NNULL))
+  if (seat_moved (seat, s) || !clear_seat (seat, s))
     {
      /* failed to remove. let others do it in the future, skip and go next pos */
-      unhold_bucket (p->v, v);
+      unhold_node (h, p, v);
       return 0;
     }
-  atomic_sub1 (h->ht[idx].ncur);
-  void *user_data = p->data;
-  memset (p, 0, sizeof (*p));
-  add1 (h->stats.expires);
+  seat_released (h, idx, v, seat_of (seat, p));
+  void *user_data = node_data (h, p);
+  count (h, expires);
   /* return this hash node for caller re-use */
   /* strict version: if (!node_rtn || !cas(node_rtn, NNULL, mi)) */
-  if (node_rtn && *node_rtn == NNULL)
-    *node_rtn = mi;
+  if (seat && node_rtn && *node_rtn == NNULL && !(h->flags & HASH_EPOCH))
+    {
+      node_clear (h, p);
+      fence (); /* released before parked threads are looked up */
+      unpark (h, p);
+      *node_rtn = s.mi;
+    }
   else
-    free_node (h, mi);
+    release_node (h, p, seat, s.mi);
   if (h->on_ttl)
     h->on_ttl (user_data, data_rtn);
   return 0;
 }
 
-/*Fibonacci number: 16bit->40543, 32bit->2654435769, 64bit->11400714819323198485 */
 #if NKEY == 4
-#define collect_hash_pos(d, a)  do { register htab_t *pt; i = 0;\
-  for (pt = &h->ht[0]; pt < &h->ht[NMHT]; pt++) { \
-    a[i++] = &pt->b[d[0] % pt->nb]; \
-    a[i++] = &pt->b[d[1] % pt->nb]; \
-    a[i++] = &pt->b[d[2] % pt->nb]; \
-    a[i++] = &pt->b[d[3] % pt->nb]; \
-    for (j = 1; j < NCLUSTER; j++) { \
-      a[i++] = &pt->b[(d[3] + j * d[0]) % pt->nb]; \
-      a[i++] = &pt->b[(d[0] + j * d[1]) % pt->nb]; \
-      a[i++] = &pt->b[(d[1] + j * d[2]) % pt->nb]; \
-      a[i++] = &pt->b[(d[2] + j * d[3]) % pt->nb]; \
-    } \
-  }}while (0)
+#define collect_hash_pos(d, g)  do { register htab_t *pt = &h->ht[0]; \
+  register nid g0, g1; \
+  g0 = reduce (pt, d[0]); g1 = reduce (pt, d[1]); \
+  g[0] = group_of (pt, g0); \
+  g[1] = group_of (pt, next_group (pt, g0, g1)); \
+  pt = &h->ht[1]; \
+  g0 = reduce (pt, d[2]); g1 = reduce (pt, d[3]); \
+  g[2] = group_of (pt, g0); \
+  g[3] = group_of (pt, next_group (pt, g0, g1)); \
+  }while (0)
 #elif NKEY == 3
-#define collect_hash_pos(d, a)  do { register htab_t *pt; i = 0;\
-  for (pt = &h->ht[0]; pt < &h->ht[NMHT]; pt++) { \
-    a[i++] = &pt->b[d[0] % pt->nb]; \
-    a[i++] = &pt->b[d[1] % pt->nb]; \
-    a[i++] = &pt->b[d[2] % pt->nb]; \
-    a[i++] = &pt->b[(d[2] + d[0]) % pt->nb]; \
-    a[i++] = &pt->b[(d[0] + d[1]) % pt->nb]; \
-    a[i++] = &pt->b[(d[1] + d[2]) % pt->nb]; \
-    a[i++] = &pt->b[(d[2] - d[0]) % pt->nb]; \
-    a[i++] = &pt->b[(d[0] - d[1]) % pt->nb]; \
-    a[i++] = &pt->b[(d[1] - d[2]) % pt->nb]; \
-  }}while (0)
+#define collect_hash_pos(d, g)  do { register htab_t *pt = &h->ht[0]; \
+  register nid g0, g1; \
+  g0 = reduce (pt, d[0]); g1 = reduce (pt, d[1]); \
+  g[0] = group_of (pt, g0); \
+  g[1] = group_of (pt, next_group (pt, g0, g1)); \
+  pt = &h->ht[1]; \
+  g0 = reduce (pt, d[2]); g1 = reduce (pt, d[0] + d[1]); \
+  g[2] = group_of (pt, g0); \
+  g[3] = group_of (pt, next_group (pt, g0, g1)); \
+  }while (0)
 #endif
-/*
-#define collect_hash_pos(d, a)  do { register htab_t *pt; j = 0;\
-  for (pt = &h->ht[0]; pt < &h->ht[NMHT]; pt++){ \
-    for(i = 0; i < NKEY; i++) \
-      a[j++] = &pt->b[d[i] % pt->nb]; \
-    for(i = 0; i < NKEY; i++) \
-      a[j++] = &pt->b[(d[i] + d[(i+1)%NKEY]) % pt->nb]; \
-  }}while (0)
-*/
 
-#define idx(j) (j<(NCLUSTER*NKEY)?0:1)
-int
-atomic_hash_add (hash_t *h, void *kwd, int len, void *data,
-		 int init_ttl, hook cbf_dup, void *arg)
+/* one key on its way through hashing, seat matching and probing */
+typedef struct probe
 {
-  register unsigned int i, j;
-  register nid mi;
-  register node_t *p;
-  memword nid *a[NSEAT];
-  memword union { hv v; nid d[NKEY]; } t;
-  nid ni = NNULL;
-  unsigned long now = nowms ();
+  union { hv v; nid d[NKEY]; } t;
+  seat_t *g[NGRP];
+  unsigned int mt[NGRP];
+  unsigned int ng; /* groups to probe: 1 if no key of home is seated away */
+  nid tag, home;
+  unsigned long sh; /* stash_hash of the key */
+  unsigned int mseq; /* h->mseq[home] when groups were matched */
+} probe_t;
+
+#define NBATCH 16 /* keys hashed and prefetched together by *_batch */
+#define PROBE_WRITE 1 /* add or del: prefetch seats for write */
+#define PROBE_FILTER 2 /* get or del: a bloom filter miss ends the call */
+
+/* prefetch all lines of a group: 1 of seats, or 4 of HASH_INLINE nodes */
+#define prefetch_group(h, g, rw) do { unsigned long __o; \
+  for (__o = 0; __o < (1UL << (h)->ht[0].gshift); __o += 64) \
+    __builtin_prefetch ((char *) (g) + __o, rw, 3); \
+  } while (0)
+
+/* HASH_INLINE: bit j set if node j of group g has v.y == y (y == 0: free) */
+static inline unsigned int
+match_inline (const seat_t *g, hvu y)
+{
+  const node_t *p = (const node_t *) g;
+  unsigned int j, m = 0;
+  for (j = 0; j < NGSEAT; j++)
+    m |= (ld (p[j].v.y) == y) << j;
+  return m;
+}
 
+/* hash the key and prefetch its seat groups right after hashing.
+ * return -1 (and count the miss) if the bloom filter rules the key out */
+static inline int
+probe_init (hash_t *h, probe_t *q, void *kwd, int len, int op)
+{
   if (len > 0)
-    h->hash_func (kwd, len, &t);
+    h->hash_func (kwd, len, &q->t);
   else if (len == 0)
-    memcpy (&t, kwd, sizeof(t));
+    memcpy (&q->t, kwd, sizeof(q->t));
   else
     return -3; /* key length not defined */
-  collect_hash_pos (t.d, a);
-  for (j = 0; j < NSEAT; j++)
-    if ((mi = *a[j]) != NNULL && (p = i2p (h->mp, node_t, mi)))
-      if (valid_ttl (h, now, p, a[j], mi, idx (j), &ni, NULL))
-        if (likely_equal (p->v, t.v))
-          if (try_dup (h, t.v, p, a[j], mi, idx (j), cbf_dup, arg))
-            goto hash_value_exists;
-  for (i = h->ht[NMHT].ncur, j = 0; i > 0 && j < MINTAB; j++)
-    if ((mi = h->ht[NMHT].b[j]) != NNULL && (p = i2p (h->mp, node_t, mi)) && i--)
-      if (valid_ttl (h, now, p, &h->ht[NMHT].b[j], mi, NMHT, &ni, NULL))
-        if (likely_equal (p->v, t.v))
-          if (try_dup (h, t.v, p, &h->ht[NMHT].b[j], mi, NMHT, cbf_dup, arg))
-            goto hash_value_exists;
-  if (ni == NNULL && (ni = new_node (h)) == NNULL)
-    return -2;	/* hash node exhausted */
-  p = i2p (h->mp, node_t, ni);
-  set_hash_node (p, t.v, data, (init_ttl > 0 ? init_ttl + now : 0));
-  for (j = 0; j < NSEAT; j++)
-    if (*a[j] == NNULL)
-      if (try_add (h, p, a[j], ni, idx (j), arg))
-        return 0;	/* hash value added */
-  if (h->ht[NMHT].ncur < MINTAB)
-    for (j = 0; j < MINTAB; j++)
-      if (h->ht[NMHT].b[j] == NNULL)
-        if (try_add (h, p, &h->ht[NMHT].b[j], ni, NMHT, arg))
-          return 0; /* hash value added */
-  memset (p, 0, sizeof (*p));
+  if (small (h)) /* 0 marks held and free snode_t */
+    {
+      if ((nid) q->t.v.x == 0)
+        q->t.v.x |= 1;
+      if ((nid) q->t.v.y == 0)
+        q->t.v.y |= 1;
+    }
+  if ((op & PROBE_FILTER) && h->bf && !bloom_test (h, q->t.v))
+    {
+      count (h, bloom_neg);
+      if (op & PROBE_WRITE)
+        count (h, del_nohit);
+      else
+        count (h, get_nohit);
+      return -1;
+    }
+  collect_hash_pos (q->t.d, q->g);
+  q->tag = hash_tag (q->t.v);
+  q->sh = stash_hash (q->t.v);
+  q->home = reduce (&h->ht[0], q->t.d[0]);
+  if (h->prefetch)
+    {
+      __builtin_prefetch (&h->ovf[q->home], 0, 3);
+      if (h->mseq)
+        __builtin_prefetch (&h->mseq[q->home], 0, 3);
+      if (op & PROBE_WRITE)
+        prefetch_group (h, q->g[0], 1);
+      else
+        prefetch_group (h, q->g[0], 0);
+    }
+  return 0;
+}
+
+/* match tags of the home group, and of the other groups only if some keys of
+ * home are seated away; prefetch matched nodes as soon as their seats are
+ * read, so the seat -> node misses overlap. HASH_INLINE groups hold the
+ * nodes, so match hv.y directly */
+static inline void
+probe_match (hash_t *h, probe_t *q)
+{
+  unsigned int k, m;
+  if (h->mseq)
+    q->mseq = ld_acq (h->mseq[q->home]); /* before any seat is read */
+  q->ng = ld (h->ovf[q->home]) ? NGRP : 1;
+  if (h->prefetch)
+    for (k = 1; k < q->ng; k++)
+      prefetch_group (h, q->g[k], 0);
+  if (h->prefetch && q->ng > 1 && ld (h->ht[NMHT].ncur) > 0)
+    for (k = 0; k < NSTASH && ld (h->stash[k]); k++)
+      __builtin_prefetch (stash_group (h, k, q->sh), 0, 3);
+  if (h->flags & HASH_INLINE)
+    {
+      for (k = 0; k < q->ng; k++)
+        q->mt[k] = match_inline (q->g[k], q->t.v.y);
+      return;
+    }
+  for (k = 0; k < q->ng; k++)
+    {
+      q->mt[k] = match_tag (q->g[k], q->tag);
+      if (h->prefetch)
+        for (m = q->mt[k]; m; m &= m - 1)
+          __builtin_prefetch (i2p (h->mp, node_t, ld_acq (q->g[k][ctz (m)].mi)), 0, 3);
+    }
+}
+
+#define idx(k) (k<NGROUP?0:1)
+#define inode(g, j) (&((node_t *) (g))[j]) /* HASH_INLINE node j of group g */
+/* HASH_DISPLACE: a key may move to an earlier probed group under a lookup,
+ * or be held by its move (or by HASH_COMPACT's), so a miss only counts once
+ * the running moves of keys of its home group are done and none ran since
+ * its groups were matched. Moves of other keys never touch its seats */
+static inline int
+keys_moved (hash_t *h, probe_t *q)
+{
+  unsigned long l = MAXSPIN;
+  unsigned int s;
+  if (!h->mseq)
+    return 0;
+  rfence (); /* seats read by the probe before the moves */
+  while (((s = ld_acq (h->mseq[q->home])) & MOVES_RUN) && --l)
+    if (l & 0x0f) __asm__("pause"); else sched_yield();
+  return (s ^ q->mseq) >= MOVE_DONE;
+}
+
+/* begin and end a move of a key of home; a move that held the key counts as done */
+#define move_begin(h, home) atomic_add1 ((h)->mseq[home]) /* before the hold: lookups meeting it wait */
+#define move_end(h, home, held) __atomic_fetch_add (&(h)->mseq[home], (held) ? MOVE_DONE - 1 : (unsigned int) -1, \
+                                                    memory_order_seq_cst)
+
+/* HASH_DISPLACE: empty seat t of array idx by moving its key to a free seat
+ * in another group of that key (one level deep, no chain of moves). The key
+ * is held while it moves, and is seated in both places until the old seat
+ * is cleared, so a lookup finds it or sees the move word of its home change.
+ * return 1 if t is empty */
+static int
+displace (hash_t *h, seat_t *t, int idx)
+{
+  probe_t q;
+  memword seat_t e, *f;
+  unsigned int k, m, *o;
+  node_t *r;
+  nid home;
+  int held = 0;
+  hv v;
+  if ((e.all = ld_acq (t->all)) == SEAT_EMPTY)
+    return 1;
+  if (!(r = i2p (h->mp, node_t, e.mi)))
+    return 0;
+  v = node_hv (h, r);
+  if (v.x == 0 || v.y == 0 || hash_tag (v) != e.tag)
+    return 0; /* held, released or reused */
+  home = reduce (&h->ht[0], v.x);
+  move_begin (h, home);
+  if (!node_hold_x (h, r, v.x))
+    goto no_hold;
+  if (ld (r->v.y) != v.y || ld (t->all) != e.all)
+    goto no_move;
+  q.t.v = v;
+  collect_hash_pos (q.t.d, q.g);
+  for (k = 0; k < NGRP; k++)
+    {
+      if (t >= q.g[k] && t < q.g[k] + NGSEAT)
+        continue; /* the group it is moved out of */
+      for (m = match_empty (q.g[k]); m; m &= m - 1)
+        {
+          f = &q.g[k][ctz (m)];
+          if ((o = away_counter (h, f, v.x)))
+            atomic_add1 (*o); /* before the key can be seen away from home */
+          if (!cas (&f->all, SEAT_EMPTY, e.all))
+            {
+              if (o)
+                atomic_sub1 (*o);
+              continue;
+            }
+          count_cur (h, idx (k), 1);
+          if (!cas (&t->all, e.all, SEAT_EMPTY))
+            { /* not expected while held, undo */
+              if (cas (&f->all, e.all, SEAT_EMPTY))
+                {
+                  count_cur (h, idx (k), -1);
+                  if (o)
+                    atomic_sub1 (*o);
+                }
+              goto no_move;
+            }
+          count_cur (h, idx, -1);
+          if ((o = away_counter (h, t, v.x)))
+            atomic_sub1 (*o);
+          add1 (h->stats.displaces);
+          unhold_bucket (r->v, v);
+          move_end (h, home, 1);
+          return 1;
+        }
+    }
+no_move:
+  unhold_bucket (r->v, v);
+  held = 1; /* the hold may have turned lookups away */
+no_hold:
+  move_end (h, home, held);
+  return 0;
+}
+
+/* HASH_COMPACT: move the node of seat t out of a draining block to a node
+ * popped from the free list, which has none of them. The node is held while
+ * its copy is made and the seat repointed, then cleared as if deleted: its
+ * waiters give up and their lookups probe again as for a HASH_DISPLACE move.
+ * return 1 if moved */
+static int
+relocate (hash_t *h, seat_t *t)
+{
+  memword seat_t e, s;
+  mem_pool_t *mp = h->mp;
+  node_t *r, *n;
+  unsigned int i;
+  nid ni, b, home;
+  int held = 0;
+  hv v;
+  if ((e.all = ld_acq (t->all)) == SEAT_EMPTY)
+    return 0;
+  b = e.mi >> mp->shift;
+  if (ld_acq (ld_acq (mp->dir[b >> PW2_DIR_LEAF])->rel[b & DIR_MASK]) != 2)
+    return 0;
+  r = i2p (mp, node_t, e.mi);
+  v = node_hv (h, r);
+  if (v.x == 0 || v.y == 0 || (!small (h) && hash_tag (v) != e.tag))
+    return 0; /* held, released or reused */
+  if (!freelist_pop (h, block_node (h, e.mi), &ni, 1)) /* on the numa node of r */
+    return 0;
+  if (ld_acq (ld_acq (mp->dir[ni >> mp->dshift])->rel[(ni >> mp->shift) & DIR_MASK]) >= 2)
+    {
+      free_node (h, ni); /* popped as its block was marked, retired */
+      return 0;
+    }
+  n = i2p (mp, node_t, ni);
+  home = reduce (&h->ht[0], v.x); /* HASH_SMALL keeps the low half of hv.x */
+  move_begin (h, home);
+  if (!node_hold_x (h, r, v.x))
+    goto no_hold;
+  if (node_hv (h, r).y != v.y || ld (t->all) != e.all)
+    goto no_move;
+  for (i = 0; i < mp->node_size / sizeof (unsigned long); i++) /* stale links of n may still be read */
+    st (((unsigned long *) n)[i], ld (((unsigned long *) r)[i]));
+  node_set_x (h, n, v.x); /* copied held */
+  s.mi = ni;
+  s.tag = e.tag;
+  if (!cas (&t->all, e.all, s.all))
+    goto no_move; /* not expected while held */
+  release_node (h, r, t, e.mi); /* retired */
+  add1 (h->stats.compacted);
+  move_end (h, home, 1);
+  return 1;
+no_move:
+  unhold_node (h, r, v);
+  held = 1; /* the hold may have turned lookups away */
+no_hold:
+  move_end (h, home, held);
+  node_clear (h, n);
+  free_node (h, ni);
+  return 0;
+}
+
+/* HASH_COMPACT: visit num seats of arrays 1, 2 and the stash from h->ccur on,
+ * moving nodes out of draining blocks; a pass over all seats starts over.
+ * return # of nodes moved */
+static unsigned long
+compact_seats (hash_t *h, unsigned long num)
+{
+  unsigned long i, c, nb, moved = 0;
+  unsigned int j, l;
+  seat_t *b;
+  for (i = 0; i < num; i++)
+    {
+      c = h->ccur++;
+      for (j = 0, b = NULL; j < NMHT; c -= nb, j++)
+        if (c < (nb = h->ht[j].nb))
+          {
+            b = h->ht[j].b;
+            break;
+          }
+      for (l = 0; !b && l < NSTASH && ld (h->stash[l]); c -= nb, l++)
+        if (c < (nb = (unsigned long) MINTAB << l))
+          {
+            b = ld_acq (h->stash[l]);
+            break;
+          }
+      if (!b)
+        {
+          h->ccur = 0; /* pass done */
+          continue;
+        }
+      moved += relocate (h, &b[c]);
+    }
+  return moved;
+}
+
+static inline int
+probe_add (hash_t *h, probe_t *q, unsigned long now, void *data,
+	   int init_ttl, hook cbf_dup, void *arg)
+{
+  register unsigned int j, k, l, m;
+  register node_t *p, *r;
+  memword seat_t s, e, **g = q->g, *c;
+  nid ni = NNULL, tag = q->tag;
+  unsigned long expire = (init_ttl > 0 ? init_ttl + now : 0);
+  int retry = 0;
+
+probe_again:
+  if (h->flags & HASH_INLINE)
+    {
+      s.all = SEAT_EMPTY; /* unused by inline nodes */
+      for (k = 0; k < q->ng; k++)
+        for (m = q->mt[k]; m; m &= m - 1)
+          if (valid_ttl (h, now, p = inode (g[k], ctz (m)), NULL, s, idx (k), NULL, NULL))
+            if (try_dup (h, q->t.v, p, NULL, s, idx (k), cbf_dup, arg))
+              goto hash_value_exists;
+    }
+  else
+    for (k = 0; k < q->ng; k++)
+      for (m = q->mt[k]; m; m &= m - 1)
+        if ((s.all = ld_acq (g[k][j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &g[k][j], s, idx (k), &ni, NULL))
+            if (node_equal (h, p, q->t.v))
+              if (try_dup (h, q->t.v, p, &g[k][j], s, idx (k), cbf_dup, arg))
+                goto hash_value_exists;
+  if (q->ng > 1 && ld (h->ht[NMHT].ncur) > 0)
+    for (l = 0; l < NSTASH && ld (h->stash[l]); l++)
+      for (m = match_tag (c = stash_group (h, l, q->sh), tag); m; m &= m - 1)
+        if ((s.all = ld_acq (c[j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &c[j], s, NMHT, &ni, NULL))
+            if (node_equal (h, p, q->t.v))
+              if (try_dup (h, q->t.v, p, &c[j], s, NMHT, cbf_dup, arg))
+                goto hash_value_exists;
+  if (keys_moved (h, q) && retry++ < DISPLACE_RETRY)
+    {
+      probe_match (h, q);
+      goto probe_again;
+    }
+  if (h->flags & HASH_INLINE)
+    {
+      if (h->bf)
+        bloom_add (h, q->t.v); /* before the key can be seen in any seat */
+      for (k = 0; k < NGRP; k++)
+        for (m = match_inline (g[k], 0); m; m &= m - 1)
+          if (try_add_inline (h, inode (g[k], ctz (m)), q->t.v, data, expire, idx (k), arg))
+            goto inline_added;
+      /* all seats taken: reclaim expired nodes of other keys before overflow */
+      for (k = 0; k < NGRP; k++)
+        for (j = 0; j < NGSEAT; j++)
+          if (ld ((r = inode (g[k], j))->v.y) != 0 && ld (r->v.y) != q->t.v.y)
+            if (!valid_ttl (h, now, r, NULL, s, idx (k), NULL, NULL) && ld (r->v.y) == 0)
+              if (try_add_inline (h, r, q->t.v, data, expire, idx (k), arg))
+                goto inline_added;
+      if (ni == NNULL && (ni = new_node (h)) == NNULL)
+        {
+          if (h->bf)
+            bloom_del (h, q->t.v);
+          return -2; /* hash node exhausted */
+        }
+      p = i2p (h->mp, node_t, ni);
+      set_hash_node (h, p, q->t.v, data, expire);
+    }
+  else
+    {
+      if (ni == NNULL && (ni = new_node (h)) == NNULL)
+        return -2;	/* hash node exhausted */
+      p = i2p (h->mp, node_t, ni);
+      set_hash_node (h, p, q->t.v, data, expire);
+      if (h->bf)
+        bloom_add (h, q->t.v); /* before the key can be seen in any seat */
+    }
+  s.mi = ni;
+  s.tag = tag;
+  if (!(h->flags & HASH_INLINE))
+    {
+      for (k = 0; k < NGRP; k++)
+        for (m = match_empty (g[k]); m; m &= m - 1)
+          if (try_add (h, p, q->t.v, &g[k][ctz (m)], s, idx (k), arg))
+            return 0;	/* hash value added */
+      /* all seats taken: reclaim expired nodes of other keys before overflow */
+      for (k = 0; k < NGRP; k++)
+        for (j = 0; j < NGSEAT; j++)
+          if ((e.all = ld_acq (g[k][j].all)) != SEAT_EMPTY && e.tag != tag && (r = i2p (h->mp, node_t, e.mi)))
+            if (!valid_ttl (h, now, r, &g[k][j], e, idx (k), NULL, NULL) && ld (g[k][j].all) == SEAT_EMPTY)
+              if (try_add (h, p, q->t.v, &g[k][j], s, idx (k), arg))
+                return 0;	/* hash value added */
+      if (h->flags & HASH_DISPLACE)
+        for (k = 0; k < NGRP; k++)
+          for (j = 0; j < NGSEAT; j++)
+            if (displace (h, &g[k][j], idx (k)) && try_add (h, p, q->t.v, &g[k][j], s, idx (k), arg))
+              return 0;	/* hash value added */
+    }
+  for (l = 0; l < NSTASH && (ld (h->stash[l]) || stash_grow (h, l)); l++)
+    for (m = match_empty (c = stash_group (h, l, q->sh)); m; m &= m - 1)
+      if (try_add (h, p, q->t.v, &c[ctz (m)], s, NMHT, arg))
+        return 0; /* hash value added */
+  if (h->bf)
+    bloom_del (h, q->t.v);
+  node_clear (h, p);
   free_node (h, ni);
   add1 (h->stats.add_nosit);
   return -1; /* add but fail */
-  
+
+inline_added:
+  if (ni != NNULL)
+    free_node (h, ni);
+  return 0; /* hash value added */
+
 hash_value_exists:
   if (ni != NNULL)
     free_node (h, ni);
   return 1; /* hash value exists */
 }
 
-int
-atomic_hash_get (hash_t *h, void *kwd, int len, hook cbf, void *arg)
+static inline int
+probe_get (hash_t *h, probe_t *q, unsigned long now, hook cbf, void *arg, mag_t *ge)
 {
-  register unsigned int i, j;
-  register nid mi;
+  register unsigned int j, k, l, m;
   register node_t *p;
-  memword nid *a[NSEAT];
-  memword union { hv v; nid d[NKEY]; } t;
-  unsigned long now = nowms ();
+  memword seat_t s, **g = q->g, *c;
+  nid tag = q->tag;
+  int retry = 0;
 
-  if (len > 0)
-    h->hash_func (kwd, len, &t);
-  else if (len == 0)
-    memcpy (&t, kwd, sizeof(t));
+probe_again:
+  if (h->flags & HASH_INLINE)
+    {
+      s.all = SEAT_EMPTY; /* unused by inline nodes */
+      for (k = 0; k < q->ng; k++)
+        for (m = q->mt[k]; m; m &= m - 1)
+          if (valid_ttl (h, now, p = inode (g[k], ctz (m)), NULL, s, idx (k), NULL, NULL))
+            if (get_node (h, q->t.v, p, NULL, s, idx (k), cbf, arg, now, ge))
+              return 0;
+    }
   else
-    return -3; /* key length not defined */
-  collect_hash_pos (t.d, a);
-  for (j = 0; j < NSEAT; j++)
-    if ((mi = *a[j]) != NNULL && (p = i2p (h->mp, node_t, mi)))
-      if (valid_ttl (h, now, p, a[j], mi, idx (j), NULL, NULL))
-	if (likely_equal (p->v, t.v))
-          if (try_get (h, t.v, p, a[j], mi, idx (j), cbf, arg))
-	    return 0;
-  for (j = i = 0; i < h->ht[NMHT].ncur && j < MINTAB; j++)
-    if ((mi = h->ht[NMHT].b[j]) != NNULL && (p = i2p (h->mp, node_t, mi)) && ++i)
-      if (valid_ttl (h, now, p, &h->ht[NMHT].b[j], mi, NMHT, NULL, NULL))
-	if (likely_equal (p->v, t.v))
-          if (try_get (h, t.v, p, &h->ht[NMHT].b[j], mi, NMHT, cbf, arg))
-	    return 0;
-  add1 (h->stats.get_nohit);
+    for (k = 0; k < q->ng; k++)
+      for (m = q->mt[k]; m; m &= m - 1)
+        if ((s.all = ld_acq (g[k][j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &g[k][j], s, idx (k), NULL, NULL))
+	    if (node_equal (h, p, q->t.v))
+              if (get_node (h, q->t.v, p, &g[k][j], s, idx (k), cbf, arg, now, ge))
+	        return 0;
+  if (q->ng > 1 && ld (h->ht[NMHT].ncur) > 0)
+    for (l = 0; l < NSTASH && ld (h->stash[l]); l++)
+      for (m = match_tag (c = stash_group (h, l, q->sh), tag); m; m &= m - 1)
+        if ((s.all = ld_acq (c[j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &c[j], s, NMHT, NULL, NULL))
+	    if (node_equal (h, p, q->t.v))
+              if (get_node (h, q->t.v, p, &c[j], s, NMHT, cbf, arg, now, ge))
+	        return 0;
+  if (keys_moved (h, q) && retry++ < DISPLACE_RETRY)
+    {
+      probe_match (h, q);
+      goto probe_again;
+    }
+  if (h->bf)
+    count (h, bloom_fp);
+  count (h, get_nohit);
   return -1;
 }
 
-int
-atomic_hash_del (hash_t *h, void *kwd, int len, hook cbf, void *arg)
+static inline int
+probe_del (hash_t *h, probe_t *q, unsigned long now, hook cbf, void *arg)
 {
-  register unsigned int i, j;
-  register nid mi;
+  register unsigned int i, j, k, l, m;
   register node_t *p;
-  memword nid *a[NSEAT];
-  memword union { hv v; nid d[NKEY]; } t;
-  unsigned long now = nowms ();
+  memword seat_t s, **g = q->g, *c;
+  nid tag = q->tag;
+  int retry = 0;
 
-  if (len > 0)
-    h->hash_func (kwd, len, &t);
-  else if (len == 0)
-    memcpy (&t, kwd, sizeof(t));
-  else
-    return -3; /* key length not defined */
-  collect_hash_pos (t.d, a);
   i = 0; /* delete all matches */
-  for (j = 0; j < NSEAT; j++)
-    if ((mi = *a[j]) != NNULL && (p = i2p (h->mp, node_t, mi)))
-      if (valid_ttl (h, now, p, a[j], mi, idx (j), NULL, NULL))
-        if (likely_equal (p->v, t.v))
-          if (try_del (h, t.v, p, a[j], mi, idx (j), cbf, arg))
-            i++;
-  if (h->ht[NMHT].ncur > 0)
-    for (j = 0; j < MINTAB; j++)
-      if ((mi = h->ht[NMHT].b[j]) != NNULL && (p = i2p (h->mp, node_t, mi)))
-        if (valid_ttl (h, now, p, &h->ht[NMHT].b[j], mi, NMHT, NULL, NULL))
-          if (likely_equal (p->v, t.v))
-            if (try_del (h, t.v, p, &h->ht[NMHT].b[j], mi, NMHT, cbf, arg))
+probe_again:
+  if (h->flags & HASH_INLINE)
+    {
+      s.all = SEAT_EMPTY; /* unused by inline nodes */
+      for (k = 0; k < q->ng; k++)
+        for (m = q->mt[k]; m; m &= m - 1)
+          if (valid_ttl (h, now, p = inode (g[k], ctz (m)), NULL, s, idx (k), NULL, NULL))
+            if (try_del (h, q->t.v, p, NULL, s, idx (k), cbf, arg))
               i++;
+    }
+  else
+    for (k = 0; k < q->ng; k++)
+      for (m = q->mt[k]; m; m &= m - 1)
+        if ((s.all = ld_acq (g[k][j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &g[k][j], s, idx (k), NULL, NULL))
+            if (node_equal (h, p, q->t.v))
+              if (try_del (h, q->t.v, p, &g[k][j], s, idx (k), cbf, arg))
+                i++;
+  if (q->ng > 1 && ld (h->ht[NMHT].ncur) > 0)
+    for (l = 0; l < NSTASH && ld (h->stash[l]); l++)
+      for (m = match_tag (c = stash_group (h, l, q->sh), tag); m; m &= m - 1)
+        if ((s.all = ld_acq (c[j = ctz (m)].all)) != SEAT_EMPTY && s.tag == tag && (p = i2p (h->mp, node_t, s.mi)))
+          if (valid_ttl (h, now, p, &c[j], s, NMHT, NULL, NULL))
+            if (node_equal (h, p, q->t.v))
+              if (try_del (h, q->t.v, p, &c[j], s, NMHT, cbf, arg))
+                i++;
+  if (i == 0 && keys_moved (h, q) && retry++ < DISPLACE_RETRY)
+    {
+      probe_match (h, q);
+      goto probe_again;
+    }
   if (i > 0)
     return 0;
-  add1 (h->stats.del_nohit);
+  if (h->bf)
+    count (h, bloom_fp);
+  count (h, del_nohit);
   return -1;
 }
+
+/* HASH_ELASTIC, HASH_COMPACT: a numa node has two free lists. Nodes are freed to side
+ * fside and popped from it first, then from the other side, and a step moves
+ * up to num nodes from the other side to side fside, retiring those of
+ * trimmed blocks. Once the other side is empty the sides flip if blocks were
+ * marked since the last flip, so a sweep meets their nodes in either list.
+ * return # of nodes moved, 1 on a flip, 0 if no sweep is due */
+static unsigned long
+pool_sweep (hash_t *h, unsigned long num)
+{
+  nid mi[NMAG];
+  unsigned long s = ld (h->fside), r = 0;
+  unsigned int i, j, k, n;
+  for (k = 0; k < h->nnuma; k++)
+    while (r < num * (k + 1) / h->nnuma && (n = list_pop (h, free_list (h, k, !s), mi, NMAG)) > 0)
+      {
+        r += n;
+        count_free (h, mi, n, -1);
+        for (i = j = 0; i < n; i++)
+          if (!free_retired (h, mi[i]))
+            mi[j++] = mi[i];
+        if (j > 0)
+          {
+            count_free (h, mi, j, 1);
+            list_push (h, free_list (h, k, s), mi, j);
+          }
+      }
+  if (r > 0 || ld (h->nmark) == 0)
+    return r;
+  st (h->nmark, 0);
+  st (h->fside, !s);
+  return 1;
+}
+
+/* HASH_ELASTIC: with more than high of the pooled nodes free, mark blocks
+ * to release down to pool_low, keeping the reserve. Called under pool_busy.
+ * return # of blocks marked */
+static unsigned int
+pool_trim (hash_t *h, double high)
+{
+  mem_pool_t *mp = h->mp;
+  unsigned long navail, nfree, keep;
+  unsigned int n;
+  navail = (unsigned long) (ld (mp->curr_blocks) - ld (mp->rel_blocks)) * mp->blk_node_num;
+  nfree = pool_free (h);
+  keep = h->pool_low * navail;
+  if (keep < ld (h->reserve))
+    keep = ld (h->reserve);
+  if (nfree <= high * navail || (n = trim_mem_pool (mp, nfree, keep, &h->tcur, TRIM_VISIT)) == 0)
+    return 0;
+  addn (h->nmark, n);
+  return n;
+}
+
+/* free nodes a sweep step moves: a pass over the pool in SWEEP_PASS steps */
+static inline unsigned long
+sweep_step (hash_t *h)
+{
+  mem_pool_t *mp = h->mp;
+  unsigned long n = (unsigned long) (ld (mp->curr_blocks) - ld (mp->rel_blocks)) * mp->blk_node_num / SWEEP_PASS;
+  return n > SWEEP_STEP ? n : SWEEP_STEP;
+}
+
+/* HASH_ELASTIC, HASH_COMPACT: one caller per SWEEP_MS sweeps while marked
+ * nodes may be left in the free lists. Else with HASH_ELASTIC, once per
+ * TRIM_MS one caller trims when more than pool_high of the pooled nodes are
+ * free. Only ops (and the HASH_PREALLOC thread) run it, see atomic_hash_trim */
+static void
+pool_step (hash_t *h, unsigned long now)
+{
+  unsigned long t = ld (h->trim_next);
+  if (now < t || !cas (&h->trim_next, t, now + TRIM_MS))
+    return;
+  if (!cas_acq (&h->pool_busy, 0, 1))
+    {
+      st (h->trim_next, now + SWEEP_MS); /* a compaction plan runs, try again soon */
+      return;
+    }
+  if (pool_sweep (h, sweep_step (h)) > 0 || ((h->flags & HASH_ELASTIC) && pool_trim (h, h->pool_high) > 0))
+    st (h->trim_next, now + SWEEP_MS);
+  st_rel (h->pool_busy, 0);
+}
+
+long
+atomic_hash_trim (hash_t *h, unsigned long num)
+{
+  unsigned long r, n = 0, rel;
+  if (!h || !(h->flags & (HASH_ELASTIC | HASH_COMPACT)))
+    return -1;
+  if (!cas_acq (&h->pool_busy, 0, 1))
+    return 0; /* other thread runs a step */
+  rel = ld (h->stats.blk_released) + ld (h->stats.blk_drained);
+  if (h->flags & HASH_ELASTIC)
+    pool_trim (h, h->pool_low);
+  while (n < num && (r = pool_sweep (h, num - n)) > 0)
+    n += r;
+  st_rel (h->pool_busy, 0);
+  return ld (h->stats.blk_released) + ld (h->stats.blk_drained) - rel;
+}
+
+#define pool_check(h, now) do { \
+  if (((h)->flags & (HASH_ELASTIC | HASH_COMPACT)) && (now) >= ld ((h)->trim_next)) pool_step (h, now); } while (0)
+
+/* HASH_COMPACT: plan a drain if none is running and the pool is sparse but
+ * not filling up again since the last call, the free nodes of the marked
+ * blocks are then swept by pool_check. Called under h->compacting */
+static void
+compact_plan (hash_t *h)
+{
+  mem_pool_t *mp = h->mp;
+  unsigned long nfree, last;
+  unsigned int n;
+  if (ld (mp->drain_blocks) > 0)
+    return;
+  nfree = pool_free (h);
+  last = ld (h->cfree);
+  st (h->cfree, nfree);
+  if (nfree < last) /* keys come back: they would take the nodes a drain keeps out */
+    return;
+  if (nfree <= COMPACT_FREE * (ld (mp->curr_blocks) - ld (mp->rel_blocks)) * mp->blk_node_num)
+    return;
+  if (!cas_acq (&h->pool_busy, 0, 1))
+    return;
+  if ((n = drain_mem_pool (mp, nfree, &h->dcur, COMPACT_VISIT)) > 0)
+    {
+      addn (h->stats.blk_drains, n);
+      addn (h->nmark, n);
+      st (h->trim_next, 0); /* sweep from the next op on */
+    }
+  st_rel (h->pool_busy, 0);
+}
+
+long
+atomic_hash_compact (hash_t *h, unsigned long num)
+{
+  unsigned long moved;
+  if (!h || !(h->flags & HASH_COMPACT))
+    return -1;
+  if (!cas_acq (&h->compacting, 0, 1))
+    return 0; /* other thread runs it */
+  compact_plan (h);
+  moved = ld (h->mp->drain_blocks) > 0 ? compact_seats (h, num) : 0;
+  if (ld (h->mp->drain_blocks) > 0 && cas_acq (&h->pool_busy, 0, 1))
+    {
+      pool_sweep (h, num); /* also when driven by hand, with no op to sweep */
+      st_rel (h->pool_busy, 0);
+    }
+  st_rel (h->compacting, 0);
+  return moved;
+}
+
+/* HASH_COMPACT: one caller per COMPACT_MS runs a step, of enough seats for
+ * a pass in COMPACT_PASS steps: draining blocks keep their free nodes out of
+ * the pool until their last live node is moved, so a pass is bounded in time */
+static void
+compact_step (hash_t *h, unsigned long now)
+{
+  unsigned long t = ld (h->compact_next), n;
+  if (now < t || !cas (&h->compact_next, t, now + COMPACT_MS))
+    return;
+  n = (h->ht[0].nb + h->ht[1].nb + ld (h->ht[NMHT].nb)) / COMPACT_PASS;
+  atomic_hash_compact (h, n > COMPACT_STEP ? n : COMPACT_STEP);
+}
+
+#define compact_check(h, now) do { \
+  if (((h)->flags & HASH_COMPACT) && (now) >= ld ((h)->compact_next)) compact_step (h, now); } while (0)
+
+int
+atomic_hash_add (hash_t *h, void *kwd, int len, void *data,
+		 int init_ttl, hook cbf_dup, void *arg)
+{
+  probe_t q;
+  unsigned long now = nowms ();
+  int r;
+  if ((r = probe_init (h, &q, kwd, len, PROBE_WRITE)) != 0)
+    return r;
+  probe_match (h, &q);
+  r = probe_add (h, &q, now, data, init_ttl, cbf_dup, arg);
+  pool_check (h, now);
+  compact_check (h, now);
+  return r;
+}
+
+int
+atomic_hash_get (hash_t *h, void *kwd, int len, hook cbf, void *arg)
+{
+  probe_t q;
+  mag_t *ge;
+  unsigned long now = nowms ();
+  int r;
+  if ((r = probe_init (h, &q, kwd, len, PROBE_FILTER)) != 0)
+    return r;
+  ge = epoch_enter (h);
+  probe_match (h, &q);
+  r = probe_get (h, &q, now, cbf, arg, ge);
+  epoch_exit (ge);
+  pool_check (h, now);
+  compact_check (h, now);
+  return r;
+}
+
+int
+atomic_hash_del (hash_t *h, void *kwd, int len, hook cbf, void *arg)
+{
+  probe_t q;
+  unsigned long now = nowms ();
+  int r;
+  if ((r = probe_init (h, &q, kwd, len, PROBE_WRITE | PROBE_FILTER)) != 0)
+    return r;
+  probe_match (h, &q);
+  r = probe_del (h, &q, now, cbf, arg);
+  pool_check (h, now);
+  compact_check (h, now);
+  return r;
+}
+
+/* a key given again in a stage is matched again once the call for its
+ * earlier copy ran, so it sees the seats that one added or cleared. rtn:
+ * of the keys before j, -3 for a key not hashed */
+static inline int
+probe_repeated (probe_t *q, int j, int *rtn)
+{
+  int l;
+  for (l = 0; l < j; l++)
+    if (rtn[l] != -3 && !memcmp (&q[l].t.v, &q[j].t.v, sizeof (q[j].t.v)))
+      return 1;
+  return 0;
+}
+
+/* batch calls run NBATCH keys per stage: hash all and prefetch their seat
+ * groups, then match all and prefetch their nodes, then probe one by one.
+ * rtn[i] gets what the single-key call returns for key i */
+#define run_batch(op, probe_call, leave) do { \
+  probe_t q[NBATCH]; \
+  unsigned long now = nowms (); \
+  int i, j, n, nfail = 0; \
+  for (i = 0; i < num; i += NBATCH) { \
+    n = (num - i < NBATCH) ? num - i : NBATCH; \
+    for (j = 0; j < n; j++) \
+      rtn[i + j] = probe_init (h, &q[j], kwd[i + j], len[i + j], op); \
+    for (j = 0; j < n; j++) \
+      if (rtn[i + j] == 0) \
+        probe_match (h, &q[j]); \
+    for (j = 0; j < n; j++) { \
+      if (rtn[i + j] == 0 && probe_repeated (q, j, &rtn[i])) \
+        probe_match (h, &q[j]); \
+      if (rtn[i + j] == 0) \
+        rtn[i + j] = probe_call; \
+      if (rtn[i + j] != 0) \
+        nfail++; \
+    }} \
+  leave; \
+  pool_check (h, now); \
+  compact_check (h, now); \
+  return nfail; \
+  } while (0)
+
+int
+atomic_hash_add_batch (hash_t *h, void **kwd, int *len, void **data, int num,
+		       int init_ttl, hook cbf_dup, void **arg, int *rtn)
+{
+  run_batch (PROBE_WRITE, probe_add (h, &q[j], now, data[i + j], init_ttl, cbf_dup, arg ? arg[i + j] : NULL), (void) 0);
+}
+
+int
+atomic_hash_get_batch (hash_t *h, void **kwd, int *len, int num,
+		       hook cbf, void **arg, int *rtn)
+{
+  mag_t *ge = epoch_enter (h);
+  run_batch (PROBE_FILTER, probe_get (h, &q[j], now, cbf, arg ? arg[i + j] : NULL, ge), epoch_exit (ge));
+}
+
+int
+atomic_hash_del_batch (hash_t *h, void **kwd, int *len, int num,
+		       hook cbf, void **arg, int *rtn)
+{
+  run_batch (PROBE_WRITE | PROBE_FILTER, probe_del (h, &q[j], now, cbf, arg ? arg[i + j] : NULL), (void) 0);
+}
@@ -24,6 +24,8 @@
 #ifndef __ATOMIC_HASH_
 #define __ATOMIC_HASH_
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 typedef int (*callback)(void *hash_data, void *caller_data);
 typedef int (* hook) (void *hash_data, void *rtn_data);
@@ -52,32 +54,122 @@ typedef struct hv { hvu x, y; } hv;
 
 #define shared  __attribute__((aligned(64)))
 
+/* flags of hash_opts_t, chosen at create time */
+#define HASH_FASTRANGE      0x0001 /* map hash to groups by multiply-shift, no division */
+#define HASH_BLOOM          0x0002 /* counting bloom filter answers most misses */
+#define HASH_INLINE         0x0004 /* nodes stored in bucket arrays 1 and 2, no nid */
+#define HASH_DISPLACE       0x0008 /* move keys between their groups to seat new keys */
+#define HASH_ELASTIC        0x0010 /* return idle blocks of the node pool to the OS */
+#define HASH_PREALLOC       0x0020 /* helper thread keeps free nodes in reserve */
+#define HASH_COMPACT        0x0040 /* move live nodes out of sparse pool blocks */
+#define HASH_SMALL          0x0080 /* 16-byte pooled nodes, 32-bit data and coarse ttl */
+#define HASH_HUGEPAGE       0x0100 /* bucket arrays and pool blocks on huge pages */
+#define HASH_NUMA           0x0200 /* bucket arrays interleaved, pool nodes local to the caller */
+#define HASH_PREFAULT       0x0400 /* bucket arrays faulted in at create by parallel threads */
+#define HASH_OPTREAD        0x0800 /* gets read nodes by version, no hold, shared counter or ttl write */
+#define HASH_EPOCH          0x1000 /* freed nodes wait out gets in flight, registered gets hold nothing */
+#define HASH_NOSTATS        0x2000 /* count nothing but keys in use */
+
+/* node hints of hash_alloc_t */
+#define HASH_NODE_ANY        (-1)
+#define HASH_NODE_INTERLEAVE (-2) /* HASH_NUMA bucket arrays */
+
+/* caller's allocator of hash_opts_t: alloc returns size bytes aligned to align
+ * (a power of 2, at most 4096) or NULL, node is a numa node the memory should be
+ * local to or a HASH_NODE_* hint. free gets the size given to alloc */
+typedef struct hash_alloc
+{
+  void *(*alloc) (void *ctx, size_t size, size_t align, int node);
+  void (*free) (void *ctx, void *p, size_t size);
+  void *ctx;
+} hash_alloc_t;
+
+typedef struct hash_opts
+{
+  unsigned long flags;
+  double pool_low, pool_high; /* HASH_ELASTIC: free node ratios of the pool, 0 for defaults */
+  unsigned long reserve; /* HASH_PREALLOC: free nodes to keep, 0 for default */
+  const hash_alloc_t *alloc; /* all memory of the hash, NULL for posix_memalign and free */
+  unsigned long spin; /* pauses of backoff on a node held by another thread before parking, 0 for default */
+  unsigned long park_ms; /* time parked on a held node before the op gives up (escapes), 0 for default */
+} hash_opts_t;
+
 typedef uint32_t nid;
 typedef struct hstats
 {
-  unsigned long expires;
   unsigned long escapes;
   unsigned long add_nomem;
   unsigned long add_nosit;
-  unsigned long del_nohit;
-  unsigned long get_nohit;
-  unsigned long mem_htabs;
+  unsigned long mem_htabs; /* seat groups and their overflow counters */
   unsigned long mem_nodes;
   unsigned long max_nodes;
   unsigned long key_collided;
+  unsigned long mem_bloom;
+  unsigned long displaces; /* HASH_DISPLACE: keys moved to seat new keys */
+  unsigned long fl_retry;  /* failed CAS on the freelist: contention of node alloc/free */
+  unsigned long mag_refill, mag_spill; /* batches moved between magazines and freelist */
+  unsigned long blk_released; /* HASH_ELASTIC: pool blocks given back to the OS */
+  unsigned long blk_by_add; /* pool blocks allocated by adds that found no free node */
+  unsigned long compacted, blk_drains, blk_drained; /* HASH_COMPACT: nodes moved, blocks marked and emptied */
+  unsigned long mem_hugetlb, mem_thp; /* HASH_HUGEPAGE: bucket arrays on hugetlb pages, or advised for THP */
+  unsigned long retired, reclaimed; /* HASH_EPOCH: nodes put in limbo, and freed from it */
+  unsigned long parks; /* waits on held nodes that slept on a futex */
+  /* sums of the hc_t shards as of the last atomic_hash_snapshot, kept for old callers */
+  unsigned long expires, del_nohit, get_nohit, bloom_neg, bloom_fp;
 } hstats_t;
 
+#define NSHARD 64 /* shards of hc_t, one per thread up to 64 threads */
+
+/* counters of every op, sharded: a thread counts in its own cache lines,
+ * atomic_hash_snapshot sums them */
 typedef struct hash_counters
 {
-  unsigned long xadd, xget, xdel, nexp;
-} hc_t; /* 64-bytes cache line */
+  long ncur[2]; /* keys seated in array 1 and 2, net of this shard */
+  unsigned long nadd[3], ndup[3], nget[3], ndel[3]; /* per bucket array, [2] the stash */
+  unsigned long get_nohit, del_nohit, expires;
+  unsigned long bloom_neg; /* lookups answered by bloom filter alone */
+  unsigned long bloom_fp;  /* lookups passed bloom filter but missed */
+} shared hc_t;
+
+/* filled by atomic_hash_snapshot */
+typedef struct hash_snapshot
+{
+  unsigned long ncur[3], nadd[3], ndup[3], nget[3], ndel[3];
+  unsigned long get_nohit, del_nohit, expires, bloom_neg, bloom_fp;
+  hstats_t stats; /* counters kept in hash_t: rare events, memory */
+} hash_snapshot_t;
+
+#define PW2_DIR_LEAF 9 /* 512 block pointers per leaf of the block directory */
+
+typedef struct mem_dir
+{
+  void * volatile blk[1 << PW2_DIR_LEAF];
+  volatile unsigned char rel[1 << PW2_DIR_LEAF]; /* per block: 1 if given back to the OS, 2 if draining, 3 if trimmed */
+  volatile nid left[1 << PW2_DIR_LEAF]; /* per draining or trimmed block: nodes not retired yet */
+  volatile nid nfree[1 << PW2_DIR_LEAF]; /* HASH_ELASTIC, HASH_COMPACT: per block: its nodes in the free lists */
+  unsigned char node[1 << PW2_DIR_LEAF]; /* HASH_NUMA: per block: numa node its pages are bound to */
+} mem_dir_t;
+
+typedef struct hash_mem
+{
+  hash_alloc_t a;
+  int user; /* a given by the caller */
+  volatile unsigned long bytes; /* in use by the hash, mapped ones included */
+} hash_mem_t;
 
 typedef struct mem_pool
 {
-  void **ba;
-  shared nid mask, shift;	/* used for i2p() only */
-  shared nid max_blocks, blk_node_num, node_size, blk_size;
+  mem_dir_t * volatile *dir; /* block b in dir[b >> PW2_DIR_LEAF], leaves added on demand */
+  shared nid mask, shift, dshift, nshift; /* used for i2p() only, dshift = shift + PW2_DIR_LEAF, nshift = log2 node_size */
+  shared nid max_blocks, ndir, blk_node_num, node_size, blk_size;
   volatile nid curr_blocks;
+  volatile nid rel_blocks; /* blocks given back to the OS, reused first */
+  volatile nid drain_blocks; /* blocks draining (HASH_COMPACT) or trimmed (HASH_ELASTIC), not released yet */
+  nid huge; /* HASH_HUGEPAGE: 2MB blocks mapped on huge pages */
+  volatile nid hugetlb_blocks; /* of them on hugetlb pages, the others advised for THP */
+  nid numa; /* HASH_NUMA: # of numa nodes, blocks mapped and bound to one each */
+  nid mapped; /* blocks mapped by the pool for HASH_HUGEPAGE or HASH_NUMA, not from mem */
+  hash_mem_t *mem;
 } mem_pool_t;
 
 typedef union {
@@ -85,18 +177,46 @@ typedef union {
   uint64_t all;
 } cas_t;
 
+typedef union {
+  struct { nid mi, tag; }; /* tag: fingerprint of hv to skip node loads */
+  uint64_t all;
+} seat_t; /* 8 seats make one 64-bytes group */
+
+#define NMAG 64 /* free nids kept by a thread magazine */
+
+typedef struct node_mag
+{
+  struct node_mag *next, *tnext; /* in hash_t's mags, in the thread's list */
+  struct hash * volatile h; /* hash of the owner thread, NULL if free for reuse */
+  unsigned int n;
+  nid mi[NMAG];
+  volatile unsigned long epoch; /* HASH_EPOCH: epoch seen by the get in flight, 0 if none */
+} mag_t;
+
+#define NSTASH 16 /* max levels of the collision array (stash) */
+
 typedef struct hash_node
 {
   volatile hv v;
-  unsigned long expire; /* expire in ms # of gettimeofday(), 0 = never */
+  unsigned long expire; /* low 48 bits: expire in ms # of gettimeofday(), 0 = never; high 16: version */
   void *data;
 } node_t;
 
+/* HASH_SMALL node: the low halves of hv.x and hv.y as a 64-bit fingerprint */
+typedef struct hash_snode
+{
+  volatile uint32_t x, y; /* as v.x and v.y of node_t, never 0 for a key */
+  uint32_t expire; /* in 16ms ticks from hash_t's epoch, 0 = never */
+  uint32_t data; /* low 32 bits of user data */
+} snode_t;
+
 typedef struct htab
 {
-  nid *b;             /* hash tab (int arrary as memory index */
-  unsigned long ncur, n, nb;  /* nb: buckets #, set by n * r */
-  unsigned long nadd, ndup, nget, ndel;
+  seat_t *b;          /* hash tab (seat groups as memory index, or node groups if HASH_INLINE) */
+  unsigned long ncur, n, nb, ng;  /* nb: buckets #, set by n * r; ng = nb / 8; ncur of the stash kept live, see hc_t */
+  unsigned long nadd, ndup, nget, ndel; /* and ncur of array 1 and 2: hc_t sums as of the last atomic_hash_snapshot */
+  unsigned long gshift; /* log2 of group bytes: 64 (seats) or 256 (inline nodes) */
+  unsigned long msize, mkind; /* bytes of b; 0 if from the allocator, else mapped: 1 THP, 2 hugetlb, 3 normal pages */
 } htab_t;
 
 typedef struct hash
@@ -107,11 +227,40 @@ typedef struct hash
 /* hook func to deal with user data in safe zone */
   shared hook on_ttl, on_add, on_dup, on_get, on_del;
   shared volatile cas_t freelist; /* free hash node list */
-  shared htab_t ht[3]; /* ht[2] for array [MINTAB] */
+  shared hash_mem_t mem; /* allocator of all memory of the hash */
+  shared volatile cas_t *nfl; /* free list of numa node k, side s at nfl[(2k + s) * 8], but freelist for k = s = 0 */
+  shared volatile unsigned long fside, nmark; /* HASH_ELASTIC, HASH_COMPACT: side nodes are freed to, blocks marked since it flipped */
+  shared unsigned long nnuma; /* numa nodes with memory, 1 if not HASH_NUMA */
+  shared mag_t * volatile mags; /* magazines of registered threads, see atomic_hash_register */
+  shared volatile cas_t limbo[3]; /* HASH_EPOCH: nodes retired in epoch e at limbo[e % 3] */
+  shared volatile unsigned long gepoch; /* HASH_EPOCH: the global epoch, from 1 */
+  volatile int epoch_busy; /* HASH_EPOCH: a thread advances the epoch */
+  shared htab_t ht[3]; /* ht[2] for the stash, its levels in stash[] */
+  shared seat_t * volatile stash[NSTASH]; /* level l: 64 << l seats, stash[0] == ht[2].b */
   shared hstats_t stats;
+  shared hc_t *hc; /* NSHARD counter shards */
   shared void **hp;
   shared mem_pool_t *mp;
+  shared unsigned int *ovf; /* per ht[0] group: # of its keys seated elsewhere */
+  shared unsigned int *mseq; /* HASH_DISPLACE, HASH_COMPACT: per ht[0] group: moves of its keys running (low 16 bits), moves or holds done (high 16) */
+  shared uint64_t *bf; /* HASH_BLOOM: 64-bytes blocks of 128 4-bit counters */
+  unsigned long nbf;
   shared unsigned long reset_expire; /* if > 0, reset node->expire */
+  unsigned long flags; /* HASH_* options given at create time */
+  unsigned long epoch; /* HASH_SMALL: create time in ms, base of node expire ticks */
+  unsigned long prefetch; /* 1 (default): prefetch seat groups and matched nodes */
+  double pool_low, pool_high; /* HASH_ELASTIC: see hash_opts_t */
+  unsigned long spin, park_ms; /* waits on held nodes, see hash_opts_t */
+  shared volatile int parked[64]; /* threads parked on held nodes, by node address */
+  shared volatile unsigned long trim_next; /* HASH_ELASTIC, HASH_COMPACT: time of the next trim or sweep step */
+  unsigned long tcur; /* HASH_ELASTIC: block the next trim visits first */
+  volatile unsigned long reserve; /* free nodes kept by HASH_PREALLOC or atomic_hash_reserve */
+  volatile int prealloc_stop;
+  pthread_t prealloc_tid;
+  shared volatile unsigned long compact_next, ccur; /* HASH_COMPACT: time of the next step, seat cursor */
+  unsigned long dcur; /* HASH_COMPACT: block the next plan visits first */
+  unsigned long cfree; /* HASH_COMPACT: free nodes of the pool at the last plan */
+  volatile int compacting, pool_busy; /* a compaction runs, a trim, sweep or plan runs */
   shared unsigned long nmht, ncmp;
   shared unsigned long nkey, npos, nseat; /* nseat = 2*npos = 4*nkey */
   shared void *teststr;
@@ -122,7 +271,8 @@ typedef struct hash
 /*
 Summary
 This is a hash table designed with high performance, lock-free and memory-saving. Multiple threads can concurrently perform read/write/delete operations up to 10M ops/s in mordern computer platform. It supports up to 2^32 hash items with O(1) performance for both of successful and unsuccessful search from the hash table.
-By giving max hash item number, atomic_hash calculates two load factors to match expected collision rate and creates array 1 with higer load factor, array 2 with lower load factor, and a small arry 3 to store collision items. memory pool for hash nodes (not for user data) is also designed for both of high performance and memory saving.
+By giving max hash item number, atomic_hash calculates two load factors to match expected collision rate and creates array 1 with higer load factor, array 2 with lower load factor, and array 3, a stash for collision items that grows by levels of 64 << l seats on demand; a key owns one group per level, so it is found with one cache line per level instead of a scan. memory pool for hash nodes (not for user data) is also designed for both of high performance and memory saving. Its blocks are 4KB to 2MB, sized from max_nodes and found by a two-level directory, so the pool grows past max_nodes in small steps when more keys come.
+Each array is organized as 64-bytes groups of 8 seats. A seat keeps a node index plus a 32-bit tag (fingerprint of the hash value), and a key owns 2 groups in each of array 1 and 2, so a lookup touches at most 4 cache lines of seats and only loads hash nodes whose tag matches. A seat takes 8 bytes where a bare node index took 4, and a group of 8 seats counts as one position (K = 9 instead of 17), so array 1 gets about 1.2 seats per key instead of 1.05: the seats take about 10.6 to 11.5 bytes per max key for 10^5 to 10^8 keys, some 2.4x the 4.5 bytes of the old layout, and the overflow counters of the home groups 0.6 more. Groups are scanned by a SSE4.2, AVX2 or AVX-512 kernel picked at load time for the running cpu. The first group of a key in array 1 is its home group, and every home group counts its keys seated anywhere else; while that count is 0 a lookup stops after the home group.
 
 Usage
 Use below functions to create a hash handle that assosiates its arrays and memory pool, print statistics of it, or release it.
@@ -131,12 +281,47 @@ hash_t * atomic_hash_create (unsigned int max_nodes, int reset_ttl);
 int atomic_hash_stats (hash_t *h, unsigned long escaped_milliseconds);
 int atomic_hash_destroy (hash_t *h);
 
+atomic_hash_create_opts does the same with options in hash_opts_t (opts may be NULL for defaults). opts->flags is an OR of:
+
+HASH_FASTRANGE: map the 32-bit hash words to groups by multiply-shift ((d * ng) >> 32) instead of d % ng. Array sizes are unchanged so the load factors r1/r2 keep their collision rates, but no division is left on the lookup path.
+HASH_BLOOM: keep a counting bloom filter (12 4-bit counters per max_nodes, 4 counters per key in one 64-bytes block) updated on every add and removal, so most atomic_hash_get/atomic_hash_del misses are answered after one cache line. Its false positive rate is printed by atomic_hash_stats.
+HASH_INLINE: store the nodes (hv, expire, data) of bucket arrays 1 and 2 in place of their seats, 8 nodes (256 bytes) per group. A probe reads the group lines only, no node index to follow; the collision array keeps its pooled nodes. It trades 4x bucket memory for one less dependent cache miss per lookup, fits read-mostly tables sized up front.
+HASH_DISPLACE: when all seats of a new key are taken, move one of their keys to a free seat in its own other groups and take its seat (cuckoo style, one level deep), before falling back to the collision array. A key being moved is held and seated twice for a moment. Every home group has a move word, so a lookup that misses waits only for moves of keys of its home group, and probes again only if one ran since it matched. Arrays 1 and 2 are sized together for a 95% load of their seats instead of by COLLISION, array 2 with a tenth of them: about 9.4 bytes of buckets per key, the move words included, against 11.3 to 11.6 without it, and no key left to the stash (at 97% some 0.06% of keys go there). atomic_hash_stats prints bucket bytes per key and the number of moves. It is ignored with HASH_INLINE, whose nodes have no seats to move.
+HASH_ELASTIC: give idle blocks of the node pool back to the OS. The pool counts the free nodes of each block, and at most once per second one caller that finds more than opts->pool_high (default 0.5) of the pooled nodes free visits up to 4096 blocks and marks those whose nodes are all free until no more than opts->pool_low (default 0.25) would be. The free list is never taken: a numa node has two, nodes are freed to one and popped from it first, and one caller per millisecond moves 1024 nodes from the other one into it, or a thousandth of the pooled nodes if more, so a pass takes about a second of ops. A node of a marked block popped by an add or met by this sweep is dropped, the sides flip once the other list is empty, and the last node of a block to go gives it back by madvise(MADV_DONTNEED). Released blocks stay mapped and are reused before new ones are allocated. Nodes kept in thread magazines pin their blocks. The steps run in ops (add, get, del) and in the HASH_PREALLOC thread only: after a mass delete, a table with neither keeps its memory until atomic_hash_trim is called. atomic_hash_stats prints the resident and released blocks and the process RSS.
+HASH_PREALLOC: a helper thread started by atomic_hash_create_opts checks every 1ms that opts->reserve free nodes (default max_nodes / 16, at least 4 blocks) are ready in the pool and adds blocks when not, so an add rarely pays for allocating and faulting in a block. The reserve is filled before create returns, and HASH_ELASTIC never trims below it. With HASH_ELASTIC or HASH_COMPACT the thread also runs their pool steps, so idle blocks are given back while no op runs. atomic_hash_stats prints the reserve and the blocks still allocated by adds.
+HASH_COMPACT: after a wave of deletes or expiries, when more than half of the pooled nodes are free, live nodes are moved out of sparse pool blocks (no more than 1/4 live) so those blocks can be given back by madvise and reused first. A plan visits up to 4096 blocks and finds the sparse ones by their free counts as HASH_ELASTIC does, and their free nodes leave the free lists by its sweep, which runs with either flag. Every 10ms one caller of add/get/del visits 1024 seats, or a hundredth of all seats if more, so a pass ends within about a second of ops, and moves what it finds there, holding each node like HASH_DISPLACE so concurrent lookups probe again. The free nodes of a draining block are withheld only until that pass ends, and no drain is planned while the free nodes drop since the last step, so keys added back reuse the blocks given back and not new ones. Ignored with HASH_INLINE. atomic_hash_stats prints the nodes moved and the blocks drained.
+HASH_SMALL: pooled nodes of 16 bytes instead of 32, for tables bound by memory. A node keeps the low halves of hv.x and hv.y as a 64-bit fingerprint, its expire in ticks of 16ms from create time (rounded up, so never early; good for 2 years), and the low 32 bits of user data, which must then be an integer or an index rather than a pointer. mem_nodes in atomic_hash_stats is halved. HASH_DISPLACE is ignored with it, since a key is moved by its whole hv, and it is ignored with HASH_INLINE.
+HASH_HUGEPAGE: the bucket arrays of the two main tables and the pool blocks are mapped on huge pages, to cut TLB misses on big tables. Each is tried on reserved hugetlb pages first (1GB pages for arrays of 1GB or more, then 2MB pages, see /proc/sys/vm/nr_hugepages), and falls back to 2MB aligned memory advised for transparent huge pages, which the kernel may or may not back. Pool blocks are 2MB with it, one page each. The hugepage: line of atomic_hash_stats shows the array memory on hugetlb or THP, the blocks on hugetlb, and AnonHugePages of the process, i.e. THP memory actually granted.
+HASH_NUMA: for multi-socket machines. The pages of the bucket arrays are interleaved over the numa nodes with memory, and each pool block is bound to one node with its own free list, so a new node comes from the node of the calling thread (other nodes are used only when its own can not grow) and a freed node goes back to the list of its block. Thread magazines refill from the local list. With HASH_ELASTIC, HASH_COMPACT and HASH_PREALLOC every node is trimmed, drained and topped up in turn. The numa: line of atomic_hash_stats shows the blocks per node. On one node it costs nothing but mmap for blocks.
+HASH_PREFAULT: bucket arrays start as untouched zeroed pages (a zero seat is empty, since seat tags are never 0), so create returns at once and memory is committed as keys come. With this flag create faults in every page of array 1 and 2 instead, by up to one thread per cpu with 64MB or more each, for tables that must not take page faults later.
+HASH_OPTREAD: for read-mostly tables. A get reads the node without holding it: the high 16 bits of node expire are a version, odd from release until the node is filled again, and the version, hv and seat read again after the data prove the read. Only a node held by a writer or a failed check fall back to the hold; a removal or ttl refresh the hook asks for is made under the hold, and if the node changed before it, the get falls back too and the hook runs again. A hit counts in the counter shard of its thread, and the ttl is refreshed only once a quarter of it has passed (so a key read often may expire up to ttl / 4 early), so a hit writes nothing shared. on_get then runs without the hold, alongside other hooks of the key, and may get the data of a key deleted meanwhile: user data freed by on_del must outlive gets in flight. Ignored with HASH_SMALL, whose nodes have no room for the version.
+HASH_EPOCH: epoch based reclamation of pooled nodes. A node freed by del, ttl or a hook keeps its data and waits in a limbo list of the current epoch instead of going to the free list; the epoch advances once every registered thread inside a get has seen it, and the nodes retired two epochs back are cleared and freed. The gets of registered threads (atomic_hash_register) run inside their epoch and read pooled nodes without the hold: they write nothing shared, never wait on a held node and never give up on one (escapes). A removal or ttl refresh the hook asks for takes the hold as with HASH_OPTREAD, and the same fallback. Such a get may see a key whose on_add is still running, and get the data of a key deleted meanwhile, so user data freed by on_del must outlive gets in flight. Gets of other threads and all writers keep the hold, as do HASH_INLINE nodes of array 1 and 2, which are not pooled. The epoch: line of atomic_hash_stats shows the nodes retired and reclaimed.
+HASH_NOSTATS: skip the counters of ops (n_add, n_dup, n_get, n_del, misses, expires, bloom answers), all but the keys in use, which the pool needs. atomic_hash_stats and atomic_hash_snapshot then show them as 0.
+
+hash_t * atomic_hash_create_opts (unsigned int max_nodes, int reset_ttl, const hash_opts_t *opts);
+
+opts->alloc, if not NULL, is the allocator of all memory of the hash: bucket arrays, stash levels, bloom filter, pool blocks and directory, magazines and the handle itself, e.g. arenas of the caller, jemalloc arenas or a pre-faulted pinned region. alloc gets the size, an alignment (a power of 2, 4096 for pool blocks) and a numa node hint (under HASH_NUMA the node a pool block is for, HASH_NODE_INTERLEAVE for its bucket arrays, else HASH_NODE_ANY), and free gets the size back. The memory need not be zeroed. With it HASH_HUGEPAGE and HASH_NUMA place nothing themselves; HASH_HUGEPAGE still makes pool blocks 2MB. HASH_ELASTIC gives pages of idle blocks back by madvise, so its memory should then be private anonymous. The mem_alloc: line of atomic_hash_stats shows the bytes a hash holds from its allocator.
+opts->spin and opts->park_ms set how an op waits on a node held by another thread (a hold lasts for a hook call, a ttl refresh or a move): pauses in rounds of 1, 2, 4 .. 64 for up to spin pauses (default 1024), then parked on a futex of the node, woken by its holder as soon as it unholds or releases it, for up to park_ms (default 1000). Only then does the op give up on the node, counted in escapes. A hook must not wait on a node of its own key. The contention: line of atomic_hash_stats shows the waits that parked.
+
+typedef struct hash_alloc
+{
+  void *(*alloc) (void *ctx, size_t size, size_t align, int node);
+  void (*free) (void *ctx, void *p, size_t size);
+  void *ctx;
+} hash_alloc_t;
+
 The hash handle can be copied to any number of threads for calling below hash functions:
 
 int atomic_hash_add (hash_t *h, void *key, int key_len, void *user_data, int init_ttl, hook func_on_dup, void *out);
 int atomic_hash_del (hash_t *h, void *key, int key_len, hook func_on_del, void *out); //delete all matches
 int atomic_hash_get (hash_t *h, void *key, int key_len, hook func_on_get, void *out); //get the first match
 
+For many keys at once, the batch versions hash all keys first and interleave their seat and node loads, so memory latency is hidden across the batch. Key i is processed exactly like the single-key call with key[i], key_len[i] (and user_data[i]) and out[i] (out may be NULL), its return code goes to rtn[i], and the batch call returns the number of keys with non-zero rtn[i]:
+
+int atomic_hash_add_batch (hash_t *h, void **key, int *key_len, void **user_data, int num, int init_ttl, hook func_on_dup, void **out, int *rtn);
+int atomic_hash_del_batch (hash_t *h, void **key, int *key_len, int num, hook func_on_del, void **out, int *rtn);
+int atomic_hash_get_batch (hash_t *h, void **key, int *key_len, int num, hook func_on_get, void **out, int *rtn);
+
 Not like normal hash functions that return user data directly, atomic hash functions return status code -- 0 for successful operation and non-zero for unsuccessful operation. Instead, atomic hash functions call hook functions to deal with user data once they find target hash node. The hook functions should be defined as following format:
 
 typedef int (*hook)(void *hash_data, void *out)
@@ -156,6 +341,29 @@ h->on_add = your_own_on_add_hook_func;
 
 In the call time, instead of hook functions registered in on_dup/on_get/on_del, hash functions atomic_hash_add, atomic_hash_get, atomic_hash_del are able to use an alertative function as long as they obey above hook function rules. This will give flexibility to deal with different user data type in a same hash table.
 
+Each call prefetches the seat groups of the key right after hashing and the hash nodes of matched seats as soon as seats are read, so the cache misses overlap. Set h->prefetch = 0 to probe without prefetching; atomic_hash_stats prints the mode next to ops/s for comparison.
+
+Free hash nodes sit in one lock-free list shared by all threads, so with many writers its head bounces between cpus on every add and removal. A thread that calls atomic_hash_register gets its own magazine of up to NMAG (64) free nodes, refilled from and spilled to the shared list half a magazine at a time with one CAS. atomic_hash_unregister gives its nodes back, call it before the thread exits and before atomic_hash_destroy; a magazine left by one thread is reused by the next one to register. Threads that never register use the shared list directly. atomic_hash_stats prints failed CAS on the shared list (the contention), the batches moved and the registered threads.
+
+int atomic_hash_register (hash_t *h);
+int atomic_hash_unregister (hash_t *h);
+
+Counters of every op (n_cur, n_add .. get_nohit, expires, bloom) are sharded: a thread counts in a shard of NSHARD (64) of its own, cache line aligned, so ops of different threads never write the same line for them. atomic_hash_snapshot sums the shards and copies the other counters of h->stats into s, for monitoring without the printing of atomic_hash_stats; the sums are exact once no op runs. Each snapshot (so atomic_hash_stats too) also copies the sums to the counters they replaced, ncur, nadd, ndup, nget and ndel of h->ht[] and get_nohit .. bloom_fp of h->stats, for callers that still read those. With HASH_NOSTATS only the keys in use (n_cur, which pool trimming reads) are counted.
+
+int atomic_hash_snapshot (hash_t *h, hash_snapshot_t *s);
+
+Without the helper thread, the pool can be topped up to num free nodes in advance, before a warm-up for example; num is also the reserve kept by HASH_PREALLOC and HASH_ELASTIC from then on. It returns -1 if memory runs out:
+
+int atomic_hash_reserve (hash_t *h, unsigned long num);
+
+Compaction can also be driven by hand, from an idle thread for example: atomic_hash_compact visits num seats, plans a drain first if none is running, sweeps as many free nodes, and returns the nodes moved, or -1 without HASH_COMPACT:
+
+long atomic_hash_compact (hash_t *h, unsigned long num);
+
+The same goes for HASH_ELASTIC, so a table that goes idle after a mass delete gives its memory back: atomic_hash_trim marks blocks down to opts->pool_low as a trim does (without waiting for pool_high), sweeps up to num free nodes, and returns the blocks given back meanwhile, or -1 without HASH_ELASTIC or HASH_COMPACT. A sweep over all free nodes releases every marked block whose nodes are not in thread magazines:
+
+long atomic_hash_trim (hash_t *h, unsigned long num);
+
 
 About TTL
 TTL (in milliseconds) is designed to enable timer for hash nodes. Set 'reset_ttl' to 0 to disable this feature so that all hash items never expire. If reset_ttl is set to >0, you still can set 'init_ttl' to 0 to mark specified hash items that never expire.
@@ -166,9 +374,25 @@ hash_node->expire: hash node's 'expire' field. If expire == 0, this hash node wi
 
 /* return (int): 0 for successful operation and non-zero for unsuccessful operation */
 hash_t * atomic_hash_create (unsigned int max_nodes, int reset_ttl);
+hash_t * atomic_hash_create_opts (unsigned int max_nodes, int reset_ttl, const hash_opts_t *opts);
 int atomic_hash_destroy (hash_t *h);
 int atomic_hash_add (hash_t *h, void *key, int key_len, void *user_data, int init_ttl, hook func_on_dup, void *out);
 int atomic_hash_del (hash_t *h, void *key, int key_len, hook func_on_del, void *out); //delete all matches
 int atomic_hash_get (hash_t *h, void *key, int key_len, hook func_on_get, void *out); //get the first match
+/* batch calls: rtn[i] as the single-key call for key[i]; return # of non-zero rtn[i] */
+int atomic_hash_add_batch (hash_t *h, void **key, int *key_len, void **user_data, int num, int init_ttl, hook func_on_dup, void **out, int *rtn);
+int atomic_hash_del_batch (hash_t *h, void **key, int *key_len, int num, hook func_on_del, void **out, int *rtn);
+int atomic_hash_get_batch (hash_t *h, void **key, int *key_len, int num, hook func_on_get, void **out, int *rtn);
 int atomic_hash_stats (hash_t *h, unsigned long escaped_milliseconds);
+/* per-thread magazine of free nodes: call in each writer thread, unregister before it exits */
+int atomic_hash_register (hash_t *h);
+int atomic_hash_unregister (hash_t *h);
+/* sum the counter shards into s, with a copy of h->stats */
+int atomic_hash_snapshot (hash_t *h, hash_snapshot_t *s);
+/* add pool blocks until num nodes are free, kept so by HASH_PREALLOC and HASH_ELASTIC */
+int atomic_hash_reserve (hash_t *h, unsigned long num);
+/* HASH_COMPACT: visit num seats, moving nodes out of sparse blocks; return # moved */
+long atomic_hash_compact (hash_t *h, unsigned long num);
+/* HASH_ELASTIC: trim now and sweep num free nodes; return # of blocks released */
+long atomic_hash_trim (hash_t *h, unsigned long num);
 #endif
@@ -392,8 +392,13 @@ uint128 CityHash128(const char *s, size_t len) {
   }
 }
 
-#ifdef __SSE4_2__
+// Built for sse4.2 by pragma rather than -msse4.2, so the rest of the
+// library runs on any x86-64; cityhash_128 calls it only on cpus with crc32.
+#ifdef __x86_64__
+#define CITY_CRC
 #include <nmmintrin.h>
+#pragma GCC push_options
+#pragma GCC target ("sse4.2")
 
 // Requires len >= 240.
 static void CityHashCrc256Long(const char *s, size_t len,
@@ -508,13 +513,29 @@ uint128 CityHashCrc128(const char *s, size_t len) {
   }
 }
 
+#pragma GCC pop_options
+#endif
+
+#ifdef CITY_CRC
+static int city_crc;  // this cpu has sse4.2
+
+static void __attribute__ ((constructor)) city_crc_init (void) {
+  __builtin_cpu_init ();
+  city_crc = __builtin_cpu_supports ("sse4.2");
+}
 #endif
 
 
 inline void 
 cityhash_128 (const void *s, const size_t len, void *r)
 {
-  *(uint128 *)r = CityHashCrc128 ((char *)s, len);
+  // the two agree up to 900 bytes; longer keys hash by crc32 where it runs
+#ifdef CITY_CRC
+  if (city_crc)
+    *(uint128 *)r = CityHashCrc128 ((char *)s, len);
+  else
+#endif
+    *(uint128 *)r = CityHash128 ((char *)s, len);
   if (((uint64_t *)r)[0] == 0) ((uint64_t *)r)[0] += 1;
   if (((uint64_t *)r)[1] == 0) ((uint64_t *)r)[1] += 1;
 }
@@ -0,0 +1,118 @@
+/* 
+ * seat_match.c
+ *
+ * 2012-2015 Copyright (c) 
+ * Fred Huang, <divfor@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "seat_match.h"
+
+/* a vector load is atomic only per lane and not at all to ThreadSanitizer,
+ * which checks the scalar kernel's relaxed loads instead (make tsan) */
+#if (defined (__x86_64__) || defined (__i386__)) && !defined (__SANITIZE_THREAD__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+/* groups come from init_htab with 64-bytes alignment, so aligned loads are safe */
+
+static unsigned int
+match_scalar (const seat_t *g, nid tag)
+{
+  unsigned int k, tm = 0, em = 0;
+  seat_t s;
+  for (k = 0; k < NGSEAT; k++)
+    {
+      if ((s.all = __atomic_load_n (&g[k].all, memory_order_relaxed)) == SEAT_EMPTY)
+        em |= 1 << k;
+      else if (s.tag == tag)
+        tm |= 1 << k;
+    }
+  return tm | (em << NGSEAT);
+}
+
+#ifdef X86_KERNELS
+__attribute__ ((target ("sse4.2"))) static unsigned int
+match_sse42 (const seat_t *g, nid tag)
+{
+  const __m128i t = _mm_set1_epi32 (tag), e = _mm_set1_epi64x (SEAT_EMPTY);
+  unsigned int k, tm = 0, em = 0;
+  __m128i v;
+  for (k = 0; k < NGSEAT / 2; k++)
+    {
+      v = _mm_load_si128 ((const __m128i *) g + k);
+      /* sign bit of each 64-bit lane is the compare result of its tag half */
+      tm |= _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpeq_epi32 (v, t))) << (2 * k);
+      em |= _mm_movemask_pd (_mm_castsi128_pd (_mm_cmpeq_epi64 (v, e))) << (2 * k);
+    }
+  return (tm & ~em) | (em << NGSEAT);
+}
+
+__attribute__ ((target ("avx2"))) static unsigned int
+match_avx2 (const seat_t *g, nid tag)
+{
+  const __m256i t = _mm256_set1_epi32 (tag), e = _mm256_set1_epi64x (SEAT_EMPTY);
+  __m256i v0 = _mm256_load_si256 ((const __m256i *) g);
+  __m256i v1 = _mm256_load_si256 ((const __m256i *) g + 1);
+  unsigned int tm, em;
+  tm = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi32 (v0, t)))
+     | _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi32 (v1, t))) << 4;
+  em = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (v0, e)))
+     | _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (v1, e))) << 4;
+  return (tm & ~em) | (em << NGSEAT);
+}
+
+__attribute__ ((target ("avx512f"))) static unsigned int
+match_avx512 (const seat_t *g, nid tag)
+{
+  const __m512i hi = _mm512_set1_epi64 (0xFFFFFFFF00000000UL);
+  const __m512i t = _mm512_set1_epi64 ((uint64_t) tag << 32);
+  const __m512i e = _mm512_set1_epi64 (SEAT_EMPTY);
+  __m512i v = _mm512_load_si512 ((const void *) g);
+  unsigned int tm, em;
+  tm = _mm512_cmpeq_epi64_mask (_mm512_and_si512 (v, hi), t);
+  em = _mm512_cmpeq_epi64_mask (v, e);
+  return (tm & ~em) | (em << NGSEAT);
+}
+#endif
+
+seat_match_func seat_match = match_scalar;
+const char *seat_match_name = "scalar";
+
+/* one libatomic_hash.so for all hosts: pick the widest kernel this cpu runs */
+static void __attribute__ ((constructor))
+seat_match_init (void)
+{
+#ifdef X86_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512f"))
+    {
+      seat_match = match_avx512;
+      seat_match_name = "avx512";
+    }
+  else if (__builtin_cpu_supports ("avx2"))
+    {
+      seat_match = match_avx2;
+      seat_match_name = "avx2";
+    }
+  else if (__builtin_cpu_supports ("sse4.2"))
+    {
+      seat_match = match_sse42;
+      seat_match_name = "sse4.2";
+    }
+#endif
+}
@@ -0,0 +1,37 @@
+/* 
+ *  seat_match.h
+ *
+ * 2012-2015 Copyright (c) 
+ * Fred Huang, <divfor@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SEAT_MATCH_
+#define __SEAT_MATCH_
+#include "atomic_hash.h"
+
+#define NGSEAT 8 /* seats per 64-bytes group */
+#define SEAT_EMPTY ((uint64_t) 0) /* {mi = 0, tag = 0}: tags are never 0, so zeroed pages are empty seats */
+
+/* scan one group: bit k of low byte set if seat k holds 'tag',
+ * bit k of high byte set if seat k is empty */
+typedef unsigned int (*seat_match_func) (const seat_t *g, nid tag);
+
+/* picked at load time by cpu features: scalar, sse4.2, avx2 or avx512 */
+extern seat_match_func seat_match;
+extern const char *seat_match_name;
+
+#define match_tag(g, tag) (seat_match ((g), (tag)) & 0xff)
+#define match_empty(g) (seat_match ((g), 0) >> NGSEAT)
+#endif
@@ -0,0 +1,253 @@
+/* api_test: one thread checks the results the calls promise, which are
+ * exact while no other thread runs: the batch calls against the single-key
+ * ones, duplicate keys in one batch included, the memory a pool gives
+ * back, and a create that meets a failing allocator.
+ * built by "make check" against ../src, see readme.MD
+ *
+ * usage: api_test
+ * exits 1 at the first failed check */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "atomic_hash.h"
+
+#define check(c) do { if (!(c)) { \
+          printf ("%s:%d: flags[0x%lx]: check failed: %s\n", __FILE__, __LINE__, flags, #c); \
+          return 1; } } while (0)
+
+#define NKEY 40 /* more than 2 batch stages of 16 keys ... */
+#define NDIST 10 /* ... of 10 distinct keys */
+
+#define NTRIM 100000 /* keys of the pool tests */
+#define NCHURN 400000 /* keys of the compaction test, a pass in 100 steps of 10ms */
+#define DRAIN_MS 2500 /* a drain is done in that time of ops */
+
+static char keys[NKEY][16];
+
+/* caller's allocator failing its fail-th call, with the bytes it holds */
+struct fail_alloc
+{
+  unsigned long ncall, fail;
+  long bytes;
+};
+
+static void *
+fail_alloc (void *ctx, size_t size, size_t align, int node)
+{
+  struct fail_alloc *a = ctx;
+  void *p;
+  if (++a->ncall == a->fail || posix_memalign (&p, align < sizeof (void *) ? sizeof (void *) : align, size))
+    return NULL;
+  a->bytes += size;
+  return p;
+}
+
+static void
+fail_free (void *ctx, void *p, size_t size)
+{
+  struct fail_alloc *a = ctx;
+  a->bytes -= size;
+  free (p);
+}
+
+static unsigned long
+keys_in_use (hash_t *h)
+{
+  hash_snapshot_t s;
+  atomic_hash_snapshot (h, &s);
+  return s.ncur[0] + s.ncur[1] + s.ncur[2];
+}
+
+/* pool blocks not given back to the OS */
+static unsigned long
+blocks_in_use (hash_t *h)
+{
+  return h->mp->curr_blocks - h->mp->rel_blocks;
+}
+
+static unsigned long
+nowms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* add (or del if !add) keys "t<i>" for i in [from, to) but every skip-th
+ * one if skip, return # failed */
+static unsigned long
+add_del (hash_t *h, unsigned long from, unsigned long to, unsigned long skip, int add)
+{
+  unsigned long i, nfail = 0;
+  char k[16];
+  for (i = from; i < to; i++)
+    {
+      if (skip && i % skip == 0)
+        continue;
+      snprintf (k, sizeof (k), "t%lu", i);
+      if (add)
+        nfail += atomic_hash_add (h, k, strlen (k), (void *) (i + 1), 0, NULL, NULL) != 0;
+      else
+        nfail += atomic_hash_del (h, k, strlen (k), NULL, NULL) != 0;
+    }
+  return nfail;
+}
+
+/* every batch call returns per key what the single-key call would, also
+ * for a key given again in the same batch or stage */
+static int
+test_batch (unsigned long flags)
+{
+  hash_opts_t opts = { flags };
+  void *kwd[NKEY], *data[NKEY], *out[NKEY], *outp[NKEY];
+  int len[NKEY], rtn[NKEY], i;
+  hash_t *h;
+
+  check ((h = atomic_hash_create_opts (1024, 0, &opts)) != NULL);
+  for (i = 0; i < NKEY; i++)
+    {
+      snprintf (keys[i], sizeof (keys[i]), "key-%d", i % NDIST);
+      kwd[i] = keys[i];
+      len[i] = strlen (keys[i]);
+      data[i] = (void *) (uintptr_t) (i + 1);
+      outp[i] = &out[i];
+    }
+  /* keys 0 .. 9 four times over: 10 .. 15 meet theirs in the same stage,
+   * the others in an earlier one */
+  check (atomic_hash_add_batch (h, kwd, len, data, NKEY, 0, NULL, NULL, rtn) == NKEY - NDIST);
+  for (i = 0; i < NKEY; i++)
+    check (rtn[i] == (i < NDIST ? 0 : 1));
+  check (keys_in_use (h) == NDIST);
+  check (atomic_hash_add (h, keys[0], len[0], data[0], 0, NULL, NULL) == 1);
+
+  memset (out, 0, sizeof (out));
+  check (atomic_hash_get_batch (h, kwd, len, NKEY, NULL, outp, rtn) == 0);
+  for (i = 0; i < NKEY; i++)
+    check (rtn[i] == 0 && out[i] == data[i % NDIST]);
+
+  /* the first of a key deletes it, the second misses */
+  check (atomic_hash_del_batch (h, kwd, len, NKEY, NULL, outp, rtn) == NKEY - NDIST);
+  for (i = 0; i < NKEY; i++)
+    check (rtn[i] == (i < NDIST ? 0 : -1));
+  check (keys_in_use (h) == 0);
+  check (atomic_hash_get_batch (h, kwd, len, NKEY, NULL, NULL, rtn) == NKEY);
+
+  /* a pair in one stage, with the add in between seen by both */
+  kwd[1] = keys[0];
+  len[1] = len[0];
+  check (atomic_hash_add_batch (h, kwd, len, data, 2, 0, NULL, NULL, rtn) == 1);
+  check (rtn[0] == 0 && rtn[1] == 1 && keys_in_use (h) == 1);
+  check (atomic_hash_del (h, keys[0], len[0], NULL, NULL) == 0);
+  check (atomic_hash_del (h, keys[0], len[0], NULL, NULL) == -1);
+  atomic_hash_destroy (h);
+  return 0;
+}
+
+/* HASH_ELASTIC: after a mass delete, with no op left to run the pool
+ * steps, atomic_hash_trim gives back all blocks but pool_low of them */
+static int
+test_trim (unsigned long flags)
+{
+  hash_opts_t opts = { flags };
+  hash_snapshot_t s;
+  unsigned long nblk;
+  long n;
+  hash_t *h;
+
+  check ((h = atomic_hash_create_opts (NTRIM, 0, &opts)) != NULL);
+  check (add_del (h, 0, NTRIM, 0, 1) == 0);
+  nblk = blocks_in_use (h);
+  check (add_del (h, 0, NTRIM, 0, 0) == 0 && keys_in_use (h) == 0);
+  check ((n = atomic_hash_trim (h, ~0UL)) > 0);
+  check (blocks_in_use (h) <= nblk / 4 + 1);
+  atomic_hash_snapshot (h, &s);
+  check (s.stats.blk_released + s.stats.blk_drained >= n);
+  check (add_del (h, 0, NTRIM, 0, 1) == 0 && keys_in_use (h) == NTRIM);
+  check (atomic_hash_trim (h, ~0UL) == 0 && blocks_in_use (h) >= nblk - 1);
+  check (atomic_hash_destroy (h) == 0);
+  check ((h = atomic_hash_create_opts (NTRIM, 0, NULL)) != NULL);
+  check (atomic_hash_trim (h, ~0UL) == -1);
+  atomic_hash_destroy (h);
+  return 0;
+}
+
+/* HASH_COMPACT: keys deleted but one in 5 leave every block sparse. The
+ * gets that follow drain them in bounded time, so the keys added back find
+ * the released blocks and the pool does not grow, round after round */
+static int
+test_compact (unsigned long flags)
+{
+  hash_opts_t opts = { flags };
+  unsigned long nblk, round, t;
+  hash_t *h;
+
+  check ((h = atomic_hash_create_opts (NCHURN, 0, &opts)) != NULL);
+  check (add_del (h, 0, NCHURN, 0, 1) == 0);
+  nblk = h->mp->curr_blocks;
+  for (round = 0; round < 2; round++)
+    {
+      check (add_del (h, 0, NCHURN, 5, 0) == 0);
+      for (t = nowms (); nowms () - t < DRAIN_MS && (h->stats.blk_drains == 0 || h->mp->drain_blocks > 0);)
+        atomic_hash_get (h, "none", 4, NULL, NULL);
+      check (h->stats.blk_drains > 0 && h->mp->drain_blocks == 0);
+      check (blocks_in_use (h) < nblk * 2 / 3); /* planned while the deletes ran */
+      check (add_del (h, 0, NCHURN, 5, 1) == 0 && keys_in_use (h) == NCHURN);
+      check (h->mp->curr_blocks <= nblk);
+    }
+  atomic_hash_destroy (h);
+  return 0;
+}
+
+/* opts->alloc failing any one call: create returns NULL and holds no
+ * memory, whichever call it is, until the first create that succeeds */
+static int
+test_alloc (unsigned long flags)
+{
+  struct fail_alloc a = { 0 };
+  hash_alloc_t alloc = { fail_alloc, fail_free, &a };
+  hash_opts_t opts = { flags };
+  hash_t *h;
+
+  opts.alloc = &alloc;
+  for (a.fail = 1; a.fail < 1000; a.fail++)
+    {
+      a.ncall = 0;
+      if ((h = atomic_hash_create_opts (1024, 0, &opts)))
+        break;
+      check (a.bytes == 0);
+    }
+  check (h != NULL && a.fail > 1);
+  a.fail = 0;
+  check (atomic_hash_add (h, "k", 1, (void *) 1, 0, NULL, NULL) == 0);
+  check (atomic_hash_destroy (h) == 0 && a.bytes == 0);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const struct
+  {
+    int (*test) (unsigned long flags);
+    unsigned long flags;
+  } run[] = {
+    { test_batch, 0 }, { test_batch, HASH_FASTRANGE }, { test_batch, HASH_BLOOM },
+    { test_batch, HASH_INLINE }, { test_batch, HASH_DISPLACE }, { test_batch, HASH_ELASTIC | HASH_COMPACT },
+    { test_batch, HASH_SMALL }, { test_batch, HASH_OPTREAD }, { test_batch, HASH_EPOCH },
+    { test_batch, HASH_NOSTATS }, { test_batch, 0x3ffb },
+    { test_trim, HASH_ELASTIC }, { test_trim, HASH_ELASTIC | HASH_SMALL | HASH_FASTRANGE },
+    { test_trim, HASH_ELASTIC | HASH_COMPACT | HASH_DISPLACE },
+    { test_compact, HASH_COMPACT }, { test_compact, HASH_COMPACT | HASH_SMALL | HASH_DISPLACE },
+    { test_alloc, 0 }, { test_alloc, HASH_BLOOM | HASH_DISPLACE | HASH_ELASTIC | HASH_COMPACT },
+    { test_alloc, HASH_SMALL | HASH_PREALLOC | HASH_EPOCH },
+  };
+  unsigned long k;
+  int r = 0;
+
+  for (k = 0; k < sizeof (run) / sizeof (run[0]) && !r; k++)
+    r = run[k].test (run[k].flags);
+  printf ("api_test: %s\n", r ? "FAILED" : "all checks passed");
+  return r;
+}
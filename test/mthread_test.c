@@ -31,6 +31,19 @@ typedef struct teststr {
   int len;
 } teststr_t;
 
+int use_mag = 1; /* threads take node magazines by atomic_hash_register */
+int numa_secs = 0; /* > 0: numa benchmark, seconds per phase */
+
+typedef struct bench_arg {
+  hash_t *h;
+  int node, nnode, idx, nthr; /* numa node, # of nodes, thread # in the node, threads per node */
+  cpu_set_t cpus;
+  unsigned long ops[2]; /* gets of local and remote phases */
+} __attribute__ ((aligned (64))) bench_arg_t;
+
+pthread_barrier_t bench_bar;
+volatile int bench_stop;
+
 unsigned long
 now ()
 {
@@ -88,6 +101,8 @@ thread_function (void *phash)
   int tid = syscall (SYS_gettid);
   char *str = NULL, *buf = NULL;
   int ret;
+  if (use_mag)
+    atomic_hash_register (h);
   while (1)
     {
       buf = NULL;
@@ -126,6 +141,8 @@ thread_function (void *phash)
 	break;
 #endif
     }
+  if (use_mag)
+    atomic_hash_unregister (h);
   if (ret)
     return NULL;
 }
@@ -148,6 +165,122 @@ thread_prints (void *phash)
   return NULL;
 }
 
+/* numa benchmark: keys are split in one slice per node and each slice is
+ * added by threads pinned to its node, so HASH_NUMA takes its hash nodes from
+ * that node's pool. Threads then get keys of their own slice (local) and of
+ * the next node's slice (remote) */
+void *
+bench_thread (void *parg)
+{
+  bench_arg_t *g = (bench_arg_t *) parg;
+  hash_t *h = g->h;
+  teststr_t *p, * const a = (teststr_t *)h->teststr;
+  unsigned long i, k, off, n = h->teststr_num / g->nnode;
+  void *buf;
+  pthread_setaffinity_np (pthread_self (), sizeof (g->cpus), &g->cpus);
+  atomic_hash_register (h);
+  for (i = g->idx; i < n; i += g->nthr)
+    {
+      p = &a[g->node * n + i];
+      atomic_hash_add (h, p->s, p->len, p->s, 0, NULL, &buf);
+    }
+  for (k = 0; k < 2; k++)
+    {
+      pthread_barrier_wait (&bench_bar);
+      off = ((g->node + k) % g->nnode) * n;
+      while (!bench_stop)
+        {
+          p = &a[off + mt_rand () % n];
+          atomic_hash_get (h, p->s, p->len, NULL, &buf);
+          g->ops[k]++;
+        }
+      pthread_barrier_wait (&bench_bar);
+    }
+  atomic_hash_unregister (h);
+  return NULL;
+}
+
+/* cpus of numa node k, 0 if it has none */
+int node_cpus (int k, cpu_set_t *cpus)
+{
+  char name[64];
+  int a, b, c = ',', n = 0;
+  FILE *fp;
+  CPU_ZERO (cpus);
+  sprintf (name, "/sys/devices/system/node/node%d/cpulist", k);
+  if (!(fp = fopen (name, "r")))
+    return 0;
+  while (c == ',' && fscanf (fp, "%d", &a) == 1)
+    {
+      b = a;
+      if ((c = fgetc (fp)) == '-' && fscanf (fp, "%d", &b) == 1)
+        c = fgetc (fp);
+      for (; a <= b; a++, n++)
+        CPU_SET (a, cpus);
+    }
+  fclose (fp);
+  return n;
+}
+
+int
+numa_bench (teststr_t *a, unsigned long num_strings)
+{
+  hash_opts_t opts = { HASH_NUMA };
+  cpu_set_t cpus[64];
+  int nnode = 0, nthr = 0, k, i, ncpu[64];
+  unsigned long ops[2] = {0, 0};
+  bench_arg_t *g;
+  hash_t *h;
+  for (k = 0; k < 64; k++)
+    if ((ncpu[nnode] = node_cpus (k, &cpus[nnode])) > 0)
+      {
+        nthr = (nthr == 0 || ncpu[nnode] < nthr) ? ncpu[nnode] : nthr;
+        nnode++;
+      }
+  if (nnode == 0 || !(h = atomic_hash_create_opts (num_strings, TTL_ON_CREATE, &opts)))
+    return -1;
+  h->teststr = a;
+  h->teststr_num = num_strings;
+  printf ("numa bench: %d nodes, %d threads per node, %ld keys, %ds per phase\n", nnode, nthr, num_strings, numa_secs);
+  if (nnode == 1)
+    printf ("one node: remote gets are local too\n");
+  if (posix_memalign ((void **) &g, 64, nnode * nthr * sizeof (*g)))
+    return -1;
+  memset (g, 0, nnode * nthr * sizeof (*g));
+  pthread_t pid[nnode * nthr];
+  pthread_barrier_init (&bench_bar, NULL, nnode * nthr + 1);
+  for (i = 0; i < nnode * nthr; i++)
+    {
+      g[i].h = h;
+      g[i].node = i / nthr;
+      g[i].nnode = nnode;
+      g[i].idx = i % nthr;
+      g[i].nthr = nthr;
+      g[i].cpus = cpus[i / nthr];
+      if (pthread_create (&pid[i], NULL, bench_thread, &g[i]) < 0)
+        return -1;
+    }
+  for (k = 0; k < 2; k++)
+    {
+      bench_stop = 0;
+      pthread_barrier_wait (&bench_bar);
+      sleep (numa_secs);
+      bench_stop = 1;
+      pthread_barrier_wait (&bench_bar);
+    }
+  for (i = 0; i < nnode * nthr; i++)
+    {
+      pthread_join (pid[i], NULL);
+      ops[0] += g[i].ops[0];
+      ops[1] += g[i].ops[1];
+    }
+  printf ("local:\t%.2fM ops/s\nremote:\t%.2fM ops/s\n", ops[0] / 1e6 / numa_secs, ops[1] / 1e6 / numa_secs);
+  atomic_hash_stats (h, 0);
+  pthread_barrier_destroy (&bench_bar);
+  free (g);
+  return atomic_hash_destroy (h);
+}
+
 int set_cpus (int num_cpus)
 {
   cpu_set_t *cpusetp;
@@ -221,6 +354,15 @@ main (int argc, char **argv)
   printf ("%ld lines to memory.\n", num_strings);
   atomic_hash_destroy (ptmp);
 
+  if (argc >= 6 && (numa_secs = atoi (argv[5])) > 0)
+    {
+      i = numa_bench (a, num_strings);
+      for (num_strings = 0; num_strings < nlines; num_strings++)
+        free (a[num_strings].s);
+      free (a);
+      return i;
+    }
+
   phash = atomic_hash_create (num_strings, TTL_ON_CREATE);
   phash->on_add = cb_add;
   phash->on_ttl = cb_ttl;
@@ -229,6 +371,10 @@ main (int argc, char **argv)
   phash->on_del = cb_del;
   if (!phash)
     return -1;
+  if (argc >= 4)
+    phash->prefetch = atoi (argv[3]);
+  if (argc >= 5)
+    use_mag = atoi (argv[4]);
   phash->teststr = a;
   phash->teststr_num = num_strings;
   mt_srand(now());
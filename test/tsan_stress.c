@@ -0,0 +1,183 @@
+/* tsan_stress: threads add, get and del a small set of keys at random so
+ * that every node is contended, checking every value a get returns. The
+ * hash is sized for a quarter of the keys, so keys also move and fill the
+ * stash. Some adds carry a ttl of a few ms so keys expire under the ops,
+ * some ops are batches, registered threads unregister and register again,
+ * and one more thread compacts, reserves, trims and snapshots meanwhile.
+ * built by "make tsan" with -fsanitize=thread against ../src, see readme.MD
+ *
+ * usage: tsan_stress [flags [threads [ops per thread [keys]]]]
+ * exits 1 on a wrong value or a key count not back to 0 */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "atomic_hash.h"
+
+#define NB 8 /* keys of a batch */
+#define TTL_MS 4 /* ttls of adds are 1 .. TTL_MS ms */
+#define REG_OPS 4096 /* ops between unregister and register again */
+
+typedef struct stress_arg {
+  hash_t *h;
+  unsigned int seed;
+  unsigned long ops, nkey, bad, hit;
+} __attribute__ ((aligned (64))) stress_arg_t;
+
+static char (*keys)[16];
+static int stop; /* the stress threads are done */
+
+/* a batch of NB keys from k on, return # got with a wrong value */
+static unsigned long
+stress_batch (hash_t *h, unsigned long k, unsigned long nkey, unsigned long r, unsigned long *hit)
+{
+  void *kwd[NB], *data[NB], *out[NB], *outp[NB];
+  int len[NB], rtn[NB], j;
+  unsigned long bad = 0;
+  for (j = 0; j < NB; j++, k = (k + 1) % nkey)
+    {
+      kwd[j] = keys[k];
+      len[j] = strlen (keys[k]);
+      data[j] = (void *) (k + 1);
+      out[j] = NULL;
+      outp[j] = &out[j];
+    }
+  switch (r % 3)
+    {
+    case 0:
+      atomic_hash_add_batch (h, kwd, len, data, NB, (r & 4) ? 1 + r % TTL_MS : 0, NULL, NULL, rtn);
+      break;
+    case 1:
+      atomic_hash_del_batch (h, kwd, len, NB, NULL, outp, rtn);
+      break;
+    default:
+      atomic_hash_get_batch (h, kwd, len, NB, NULL, outp, rtn);
+      for (j = 0; j < NB; j++)
+        if (rtn[j] == 0)
+          {
+            (*hit)++;
+            bad += out[j] != data[j];
+          }
+    }
+  return bad;
+}
+
+/* the pool calls that run beside the ops, -1 where the flags lack */
+static void *
+pool_thread (void *parg)
+{
+  hash_t *h = (hash_t *) parg;
+  hash_snapshot_t s;
+  unsigned long i;
+  for (i = 0; !__atomic_load_n (&stop, __ATOMIC_ACQUIRE); i++)
+    {
+      atomic_hash_compact (h, 256);
+      atomic_hash_trim (h, 256);
+      if ((i & 63) == 0)
+        atomic_hash_reserve (h, (i & 64) ? 256 : 64);
+      atomic_hash_snapshot (h, &s);
+    }
+  return NULL;
+}
+
+static void *
+stress_thread (void *parg)
+{
+  stress_arg_t *a = (stress_arg_t *) parg;
+  hash_t *h = a->h;
+  unsigned long i, k, r;
+  hash_snapshot_t s;
+  void *out;
+  if (a->seed & 1) /* half of the threads take node magazines */
+    atomic_hash_register (h);
+  for (i = 0; i < a->ops; i++)
+    {
+      r = rand_r (&a->seed);
+      k = (r >> 4) % a->nkey;
+      out = NULL;
+      switch (r & 7)
+        {
+        case 0:
+          atomic_hash_add (h, keys[k], strlen (keys[k]), (void *) (k + 1), 0, NULL, NULL);
+          break;
+        case 1:
+          atomic_hash_add (h, keys[k], strlen (keys[k]), (void *) (k + 1), 1 + (r >> 20) % TTL_MS, NULL, NULL);
+          break;
+        case 2:
+          atomic_hash_del (h, keys[k], strlen (keys[k]), NULL, &out);
+          break;
+        case 3:
+          a->bad += stress_batch (h, k, a->nkey, r >> 20, &a->hit);
+          break;
+        default:
+          if (atomic_hash_get (h, keys[k], strlen (keys[k]), NULL, &out) == 0)
+            {
+              a->hit++;
+              if (out != (void *) (k + 1))
+                a->bad++;
+            }
+        }
+      if (a->seed == 1 && (i & 1023) == 0) /* counters read while they change */
+        atomic_hash_snapshot (h, &s);
+      if ((a->seed & 1) && i % REG_OPS == REG_OPS - 1)
+        {
+          atomic_hash_unregister (h);
+          atomic_hash_register (h);
+        }
+    }
+  if (a->seed & 1)
+    atomic_hash_unregister (h);
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long flags = argc > 1 ? strtoul (argv[1], NULL, 0) : 0;
+  unsigned long nthr = argc > 2 ? strtoul (argv[2], NULL, 0) : 8;
+  unsigned long ops = argc > 3 ? strtoul (argv[3], NULL, 0) : 100000;
+  unsigned long nkey = argc > 4 ? strtoul (argv[4], NULL, 0) : 256;
+  unsigned long i, bad = 0, hit = 0, ncur;
+  hash_opts_t opts = { flags };
+  hash_snapshot_t s;
+  stress_arg_t *a;
+  pthread_t *pid, pool;
+  hash_t *h;
+  void *out;
+
+  if (!nthr || !nkey || !(h = atomic_hash_create_opts (nkey / 4 + 1, 0, &opts)))
+    return 1;
+  keys = calloc (nkey, sizeof (*keys));
+  a = calloc (nthr, sizeof (*a));
+  pid = calloc (nthr, sizeof (*pid));
+  for (i = 0; i < nkey; i++)
+    snprintf (keys[i], sizeof (keys[i]), "key-%lu", i);
+  if (pthread_create (&pool, NULL, pool_thread, h) != 0)
+    return 1;
+  for (i = 0; i < nthr; i++)
+    {
+      a[i] = (stress_arg_t) { .h = h, .seed = i + 1, .ops = ops, .nkey = nkey };
+      if (pthread_create (&pid[i], NULL, stress_thread, &a[i]) != 0)
+        return 1;
+    }
+  for (i = 0; i < nthr; i++)
+    {
+      pthread_join (pid[i], NULL);
+      bad += a[i].bad;
+      hit += a[i].hit;
+    }
+  __atomic_store_n (&stop, 1, __ATOMIC_RELEASE);
+  pthread_join (pool, NULL);
+  for (i = 0; i < nkey; i++)
+    atomic_hash_del (h, keys[i], strlen (keys[i]), NULL, &out);
+  atomic_hash_snapshot (h, &s);
+  ncur = s.ncur[0] + s.ncur[1] + s.ncur[2];
+  printf ("flags[0x%lx] threads[%lu] ops[%lu] keys[%lu]: hits[%lu], bad values[%lu], expired[%lu], keys left[%lu]\n",
+          flags, nthr, nthr * ops, nkey, hit, bad, s.expires, ncur);
+  atomic_hash_destroy (h);
+  free (pid);
+  free (a);
+  free (keys);
+  return bad || ncur;
+}